@@ -0,0 +1,309 @@
+#include <math.h>
+#include "./ans.h"
+
+/* table-based asymmetric numeral systems: the counts of a block, scaled
+   to sum to a power of two, give each character that many of the table's
+   states. Coding a character moves the state to one of the character's
+   and sends the low bits that do not survive the move, so a character of
+   probability p costs close to -log2(p) bits rather than a whole number.
+   The coder runs over the block backwards and the decoder forwards, one
+   table step per character */
+
+
+/* position of the highest set bit of value, 0 for 0 and 1 */
+static int highest_bit(uint32_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+/* deal the states out to the characters, each count[s] times, stepping
+   through the table so a character's states are spread over it */
+static void spread_symbols(const uint16_t counts[], int tableLog,
+                            unsigned char symbols[]) {
+    uint32_t size = 1 << tableLog, mask = size - 1;
+    uint32_t step = (size >> 1) + (size >> 3) + 3; /* odd, visits all */
+    uint32_t position = 0;
+    int s, k;
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        for (k = 0; k < counts[s]; k++) {
+            symbols[position] = s;
+            position = (position + step) & mask;
+        }
+    }
+}
+
+/* table size for a block with this histogram: small blocks get small
+   tables, whose counts cost less header, but every character present
+   needs a state with room to tell them apart */
+int ans_table_log(const uint64_t histogram[]) {
+    uint64_t total = 0;
+    int i, present = 0, tableLog = ANS_TABLE_LOG;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        total += histogram[i];
+        present += histogram[i] > 0;
+    }
+    while (tableLog > ANS_MIN_TABLE_LOG &&
+            ((uint64_t)1 << tableLog) > total / 4) {
+        tableLog--;
+    }
+    while (tableLog < ANS_MAX_TABLE_LOG && (1 << tableLog) < 2 * present) {
+        tableLog++;
+    }
+    return tableLog;
+}
+
+/* scale the histogram to counts summing to 1 << tableLog, every present
+   character keeping at least 1; -1 if there are more characters than
+   states */
+int ans_normalize(const uint64_t histogram[], int tableLog,
+                    uint16_t counts[]) {
+    uint64_t total = 0;
+    uint32_t size = 1 << tableLog, sum = 0, count;
+    int i, largest;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        count = 0;
+        if (histogram[i] > 0) {
+            count = (histogram[i] * size * 2 + total) /
+                    (2 * total);
+            count = count > 0 ? count : 1;
+        }
+        counts[i] = count;
+        sum += count;
+    }
+    /* rounding leaves the sum a little off; the largest counts take up
+       the difference, where a state more or less changes the cost the
+       least */
+    while (sum != size) {
+        largest = -1;
+        for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+            if ((sum < size || counts[i] > 1) && counts[i] > 0 &&
+                (largest == -1 || counts[i] > counts[largest])) {
+                largest = i;
+            }
+        }
+        if (largest == -1) {
+            return -1;
+        }
+        if (sum < size) {
+            counts[largest]++;
+            sum++;
+        } else {
+            counts[largest]--;
+            sum--;
+        }
+    }
+    return 0;
+}
+
+/* body bits a histogram takes coded with counts, without the state and
+   padding */
+double ans_body_bits(const uint64_t histogram[], const uint16_t counts[],
+                        int tableLog) {
+    double bits = 0;
+    int i;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (histogram[i] > 0) {
+            bits += histogram[i] * (tableLog - log(counts[i]) / log(2));
+        }
+    }
+    return bits;
+}
+
+/* code n bytes with counts into the end of the capacity bytes at dst,
+   returning the length of the body there, or 0 when it does not fit.
+   The body starts with zero bits up to a 1, then the final state; after
+   that come the bits each step sent, in the order the decoder takes
+   them */
+size_t ans_encode(const uint16_t counts[], int tableLog,
+                    const unsigned char* data, size_t n,
+                    unsigned char* dst, size_t capacity) {
+    unsigned char symbols[1 << ANS_MAX_TABLE_LOG];
+    uint16_t states[1 << ANS_MAX_TABLE_LOG];
+    uint32_t starts[ASCII_TABLE_LENGTH];
+    int32_t deltaBits[ASCII_TABLE_LENGTH], deltaState[ASCII_TABLE_LENGTH];
+    uint32_t size = 1 << tableLog, total = 0, state, u;
+    uint64_t pending = 0; /* bits to go in front of those written */
+    unsigned char *p = dst + capacity;
+    int s, bits, pendingCount = 0, maxBits;
+
+    /* the states of each character, in table order */
+    spread_symbols(counts, tableLog, symbols);
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        starts[s] = total;
+        total += counts[s];
+    }
+    for (u = 0; u < size; u++) {
+        states[starts[symbols[u]]++] = size + u;
+    }
+    /* a state x in [size, 2 size) codes s after dropping the bits that
+       take it into [count, 2 count): maxBits, or one fewer below
+       count << maxBits, worked out with one add and shift */
+    total = 0;
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        if (counts[s] == 0) {
+            continue;
+        }
+        maxBits = tableLog - highest_bit(counts[s] - 1);
+        deltaBits[s] = (maxBits << 16) - (counts[s] << maxBits);
+        deltaState[s] = total - counts[s];
+        total += counts[s];
+    }
+
+    state = size;
+    while (n > 0) {
+        s = data[--n];
+        bits = (state + deltaBits[s]) >> 16;
+        pending |= (uint64_t)(state & ((1 << bits) - 1)) << pendingCount;
+        pendingCount += bits;
+        state = states[(state >> bits) + deltaState[s]];
+        if (pendingCount >= 32) {
+            if (p - dst < 4) {
+                return 0;
+            }
+            p -= 4;
+            p[0] = pending >> 24;
+            p[1] = pending >> 16;
+            p[2] = pending >> 8;
+            p[3] = pending;
+            pending >>= 32;
+            pendingCount -= 32;
+        }
+    }
+    /* the final state, where decoding starts, and the 1 marking it */
+    pending |= (uint64_t)(state - size) << pendingCount;
+    pendingCount += tableLog;
+    pending |= (uint64_t)1 << pendingCount;
+    pendingCount++;
+    while (pendingCount > 0) {
+        if (p == dst) {
+            return 0;
+        }
+        *--p = pending;
+        pending >>= 8;
+        pendingCount -= 8;
+    }
+    return dst + capacity - p;
+}
+
+/* decoder states from the counts of a block header, -1 when they do not
+   fill the table */
+int ans_build_decode_table(const uint16_t counts[], int tableLog,
+                            AnsDecodeTable* table) {
+    unsigned char symbols[1 << ANS_MAX_TABLE_LOG];
+    uint32_t next[ASCII_TABLE_LENGTH];
+    uint32_t size = 1 << tableLog, sum = 0, u;
+    int s, bits;
+    if (tableLog < ANS_MIN_TABLE_LOG || tableLog > ANS_MAX_TABLE_LOG) {
+        return -1;
+    }
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        sum += counts[s];
+        next[s] = counts[s];
+    }
+    if (sum != size) {
+        return -1;
+    }
+    spread_symbols(counts, tableLog, symbols);
+    /* the k-th state of s in table order undoes the coder's move into
+       it from count + k */
+    for (u = 0; u < size; u++) {
+        s = symbols[u];
+        bits = tableLog - highest_bit(next[s]);
+        table->entries[u].symbol = s;
+        table->entries[u].bits = bits;
+        table->entries[u].next = (next[s] << bits) - size;
+        next[s]++;
+    }
+    table->tableLog = tableLog;
+    return 0;
+}
+
+/* bits of a body in memory, next bit in the most significant bit */
+typedef struct AnsReader {
+    uint64_t buffer;
+    int count; /* valid bits in buffer, negative once the body ran out */
+    const unsigned char *next;
+    const unsigned char *end;
+} AnsReader;
+
+static void ans_refill(AnsReader* reader) {
+    const unsigned char *p = reader->next;
+    if (reader->end - p >= 8 && reader->count >= 0) {
+        reader->buffer |= (((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                            ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                            ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                            ((uint64_t)p[6] << 8) | (uint64_t)p[7])
+                            >> reader->count;
+        reader->next += (63 - reader->count) >> 3;
+        reader->count |= 56;
+        return;
+    }
+    while (reader->count >= 0 && reader->count <= 56 &&
+            reader->next < reader->end) {
+        reader->buffer |= (uint64_t)*reader->next++ << (56 - reader->count);
+        reader->count += 8;
+    }
+}
+
+/* one table step: the character of the state, then the next state from
+   the entry and the bits it takes; a take of 0 bits shifts in nothing */
+#define ANS_STEP(table, reader, state, out) do { \
+        const AnsDecodeEntry *entry_ = &(table)->entries[state]; \
+        (out) = entry_->symbol; \
+        (state) = entry_->next + \
+                    (uint32_t)(((reader).buffer >> 1) >> (63 - entry_->bits)); \
+        (reader).buffer <<= entry_->bits; \
+        (reader).count -= entry_->bits; \
+    } while (0)
+
+/* decode n characters from the length bytes of body into dst; -1 when
+   the body does not hold exactly them */
+int ans_decode(const AnsDecodeTable* table, const unsigned char* body,
+                size_t length, unsigned char* dst, size_t n) {
+    AnsReader reader;
+    uint32_t state;
+    size_t i;
+    int skip;
+    if (length == 0 || body[0] == 0) {
+        return -1;
+    }
+    reader.buffer = 0;
+    reader.count = 0;
+    reader.next = body;
+    reader.end = body + length;
+    ans_refill(&reader);
+    /* past the padding and its 1 to the state */
+    for (skip = 1; (body[0] & (0x80 >> (skip - 1))) == 0; skip++) {
+    }
+    reader.buffer <<= skip;
+    reader.count -= skip;
+    state = reader.buffer >> (64 - table->tableLog);
+    reader.buffer <<= table->tableLog;
+    reader.count -= table->tableLog;
+    /* a refill leaves at least 56 bits, four steps of at most 12 */
+    for (i = 0; i + 4 <= n; i += 4) {
+        ans_refill(&reader);
+        ANS_STEP(table, reader, state, dst[i]);
+        ANS_STEP(table, reader, state, dst[i + 1]);
+        ANS_STEP(table, reader, state, dst[i + 2]);
+        ANS_STEP(table, reader, state, dst[i + 3]);
+    }
+    for (; i < n; i++) {
+        ans_refill(&reader);
+        ANS_STEP(table, reader, state, dst[i]);
+    }
+    /* coding started from state 0 and used every bit */
+    if (state != 0 || reader.count != 0 || reader.next != reader.end) {
+        return -1;
+    }
+    return 0;
+}
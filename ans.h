@@ -0,0 +1,38 @@
+#ifndef ANS_H
+#define ANS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "./huffman.h"
+
+#define ANS_TABLE_LOG 11 /* table of 2048 states for blocks large enough */
+#define ANS_MIN_TABLE_LOG 5
+#define ANS_MAX_TABLE_LOG 12 /* a state and its bits fit 16 bits */
+
+/* one decoder state: the character it gives, and the state that follows
+   once next is added to the next bits bits of the body */
+typedef struct AnsDecodeEntry {
+    uint16_t next;
+    uint8_t symbol;
+    uint8_t bits;
+} AnsDecodeEntry;
+
+typedef struct AnsDecodeTable {
+    AnsDecodeEntry entries[1 << ANS_MAX_TABLE_LOG];
+    int tableLog;
+} AnsDecodeTable;
+
+int ans_table_log(const uint64_t histogram[]);
+int ans_normalize(const uint64_t histogram[], int tableLog,
+                    uint16_t counts[]);
+double ans_body_bits(const uint64_t histogram[], const uint16_t counts[],
+                        int tableLog);
+size_t ans_encode(const uint16_t counts[], int tableLog,
+                    const unsigned char* data, size_t n,
+                    unsigned char* dst, size_t capacity);
+int ans_build_decode_table(const uint16_t counts[], int tableLog,
+                            AnsDecodeTable* table);
+int ans_decode(const AnsDecodeTable* table, const unsigned char* body,
+                size_t length, unsigned char* dst, size_t n);
+
+#endif
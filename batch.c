@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "./libhuffman.h"
+#include "./parallel.h"
+
+#define BATCH_SUFFIX ".huf" /* added to coded files written alongside */
+#define BATCH_SUFFIX_LENGTH 4
+
+
+/* files shared out to the workers, and where their output goes */
+typedef struct Batch {
+    pthread_mutex_t lock;
+    HuffOptions options; /* for each file, coded by one thread */
+    char * const *paths; /* files to code or decode */
+    ArchiveMember *members; /* archive contents, written or read */
+    size_t count; /* number of paths or members */
+    size_t next; /* first file no worker has taken */
+    bool encode;
+    BufWriter *archive; /* archive being written, NULL otherwise */
+    const unsigned char *source; /* archive being extracted, in memory */
+    bool failed; /* some file could not be done */
+} Batch;
+
+/* what one worker keeps from file to file */
+typedef struct BatchWorker {
+    Batch *batch;
+    HuffContext *context; /* tables and scratch of the library */
+    unsigned char *input; /* whole file for the archive */
+    size_t inputCapacity;
+    unsigned char *output; /* coded or decoded file */
+    size_t outputCapacity;
+} BatchWorker;
+
+
+/* make *buffer hold at least n bytes, keeping it when it already does */
+static int reserve(unsigned char** buffer, size_t* capacity, size_t n) {
+    unsigned char *grown;
+    if (n <= *capacity) {
+        return 0;
+    }
+    grown = realloc(*buffer, n);
+    if (grown == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = n;
+    return 0;
+}
+
+/* read all of file into the worker's input, returning its length */
+static ssize_t read_whole(BatchWorker* worker, int file) {
+    struct stat info;
+    size_t length = 0;
+    ssize_t bytesRead;
+    if (fstat(file, &info) == -1) {
+        return -1;
+    }
+    if (reserve(&worker->input, &worker->inputCapacity,
+                S_ISREG(info.st_mode) ? info.st_size + 1 : 64 * 1024) == -1) {
+        return -1;
+    }
+    for (;;) {
+        if (length == worker->inputCapacity && reserve(&worker->input,
+                &worker->inputCapacity, 2 * worker->inputCapacity) == -1) {
+            return -1;
+        }
+        bytesRead = read(file, worker->input + length,
+                            worker->inputCapacity - length);
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return bytesRead == -1 ? -1 : (ssize_t)length;
+        }
+        length += bytesRead;
+    }
+}
+
+/* create the directories leading to path that do not exist yet */
+static int make_parents(const char* path) {
+    char *parent, *slash;
+    int result = 0;
+    parent = malloc(strlen(path) + 1);
+    if (parent == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    strcpy(parent, path);
+    for (slash = strchr(parent + 1, '/'); slash != NULL && result == 0;
+            slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(parent, S_IRWXU | S_IRWXG | S_IRWXO) == -1 &&
+            errno != EEXIST) {
+            perror(parent);
+            result = -1;
+        }
+        *slash = '/';
+    }
+    free(parent);
+    return result;
+}
+
+/* write n bytes to a new file at path, making its directories */
+static int write_whole(const char* path, const unsigned char* data,
+                        size_t n) {
+    BufWriter *out;
+    int file, result;
+    if (make_parents(path) == -1) {
+        return -1;
+    }
+    file = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (file == -1) {
+        perror(path);
+        return -1;
+    }
+    out = buf_writer_open(file, MIN_IO_BUFFER_SIZE);
+    result = out == NULL ? -1 : buf_write(out, data, n);
+    if (buf_writer_close(out) == -1 || result == -1) {
+        perror(path);
+        result = -1;
+    }
+    close(file);
+    return result;
+}
+
+/* code or decode file to or from path plus the suffix, alongside it */
+static int batch_alongside(BatchWorker* worker, const char* path) {
+    size_t length = strlen(path);
+    char *other;
+    int in, out, result;
+
+    if (!worker->batch->encode && (length <= BATCH_SUFFIX_LENGTH ||
+        strcmp(path + length - BATCH_SUFFIX_LENGTH, BATCH_SUFFIX) != 0)) {
+        fprintf(stderr, "%s: name does not end in %s\n", path, BATCH_SUFFIX);
+        return -1;
+    }
+    other = malloc(length + BATCH_SUFFIX_LENGTH + 1);
+    if (other == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    strcpy(other, path);
+    if (worker->batch->encode) {
+        strcat(other, BATCH_SUFFIX);
+    } else {
+        other[length - BATCH_SUFFIX_LENGTH] = '\0';
+    }
+    in = open(path, O_RDONLY);
+    if (in == -1) {
+        perror(path);
+        free(other);
+        return -1;
+    }
+    out = open(other, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out == -1) {
+        perror(other);
+        close(in);
+        free(other);
+        return -1;
+    }
+    result = worker->batch->encode ?
+                huff_encode_file(worker->context, in, out) :
+                huff_decode_file(worker->context, in, out);
+    close(in);
+    close(out);
+    free(other);
+    return result;
+}
+
+/* code file number i into memory and append it to the archive */
+static int batch_archive(BatchWorker* worker, size_t i) {
+    Batch *batch = worker->batch;
+    const char *path = batch->paths[i];
+    ssize_t length;
+    size_t coded;
+    int in, result;
+
+    if (strlen(path) > MAX_MEMBER_NAME) {
+        fprintf(stderr, "%s: name too long for an archive\n", path);
+        return -1;
+    }
+    in = open(path, O_RDONLY);
+    if (in == -1) {
+        perror(path);
+        return -1;
+    }
+    length = read_whole(worker, in);
+    close(in);
+    if (length == -1) {
+        perror(path);
+        return -1;
+    }
+    if (reserve(&worker->output, &worker->outputCapacity,
+            huff_compress_bound(worker->context, length)) == -1 ||
+        huff_compress(worker->context, worker->input, length,
+                        worker->output, worker->outputCapacity,
+                        &coded) == -1) {
+        return -1;
+    }
+    /* members go in the order they finish, the contents say where */
+    pthread_mutex_lock(&batch->lock);
+    batch->members[i].codedOffset = buf_position(batch->archive);
+    batch->members[i].codedLength = coded;
+    batch->members[i].decodedLength = length;
+    result = buf_write(batch->archive, worker->output, coded);
+    pthread_mutex_unlock(&batch->lock);
+    if (result == -1) {
+        perror("write");
+    }
+    return result;
+}
+
+/* decode member i of the archive to its name */
+static int batch_extract(BatchWorker* worker, size_t i) {
+    const ArchiveMember *member = &worker->batch->members[i];
+    const char *name = member->name;
+    const char *dots;
+    size_t decoded;
+
+    /* names stay below the directory the archive is extracted in */
+    for (dots = strstr(name, ".."); dots != NULL;
+            dots = strstr(dots + 1, "..")) {
+        if ((dots == name || dots[-1] == '/') &&
+            (dots[2] == '/' || dots[2] == '\0')) {
+            break;
+        }
+    }
+    if (name[0] == '/' || dots != NULL) {
+        fprintf(stderr, "%s: not extracting a name outside this "
+                "directory\n", name);
+        return -1;
+    }
+    if (member->decodedLength > SIZE_MAX ||
+        reserve(&worker->output, &worker->outputCapacity,
+                member->decodedLength) == -1 ||
+        huff_decompress(worker->context,
+                        worker->batch->source + member->codedOffset,
+                        member->codedLength, worker->output,
+                        member->decodedLength, &decoded) == -1) {
+        fprintf(stderr, "%s: cannot decode\n", name);
+        return -1;
+    }
+    if (decoded != member->decodedLength) {
+        fprintf(stderr, "%s: decoded to the wrong length\n", name);
+        return -1;
+    }
+    return write_whole(name, worker->output, decoded);
+}
+
+/* worker: take files one at a time until none are left */
+static void* batch_worker(void* arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    size_t i;
+    int result;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next < batch->count ? batch->next++ : batch->count;
+        pthread_mutex_unlock(&batch->lock);
+        if (i == batch->count) {
+            break;
+        }
+        if (batch->source != NULL) {
+            result = batch_extract(worker, i);
+        } else if (batch->archive != NULL) {
+            result = batch_archive(worker, i);
+        } else {
+            result = batch_alongside(worker, batch->paths[i]);
+        }
+        if (result == -1) {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed = true;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    return NULL;
+}
+
+/* do every file of batch on options->threads workers, each with its own
+   context and buffers */
+static int run_batch(Batch* batch, const HuffOptions* options) {
+    BatchWorker workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int i, count, started;
+
+    count = options->threads;
+    if ((size_t)count > batch->count) {
+        count = batch->count > 0 ? batch->count : 1;
+    }
+    batch->options = *options;
+    batch->options.threads = 1; /* the workers are the parallelism */
+    batch->options.inFlight = 0;
+    batch->next = 0;
+    batch->failed = false;
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < count; i++) {
+        workers[i].batch = batch;
+        workers[i].context = huff_context_new(&batch->options);
+        if (workers[i].context == NULL) {
+            if (errno != EINVAL) {
+                perror("malloc");
+            }
+            batch->failed = true;
+            count = i;
+            break;
+        }
+    }
+    pthread_mutex_init(&batch->lock, NULL);
+    started = 0;
+    if (!batch->failed) {
+        /* the calling thread is worker 0 */
+        for (started = 1; started < count; started++) {
+            if (pthread_create(&threads[started], NULL, batch_worker,
+                                &workers[started]) != 0) {
+                break;
+            }
+        }
+        batch_worker(&workers[0]);
+        for (i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&batch->lock);
+    for (i = 0; i < count; i++) {
+        huff_context_free(workers[i].context);
+        free(workers[i].input);
+        free(workers[i].output);
+    }
+    return batch->failed ? -1 : 0;
+}
+
+/* code each of count files, on options->threads files at once, to the
+   file's name plus .huf, or into one archive when archive is not NULL;
+   a file that fails is reported and the others still get done */
+int huff_encode_batch(const HuffOptions* options, char* const paths[],
+                        size_t count, const char* archive) {
+    Batch batch;
+    size_t i;
+    int file, result;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.paths = paths;
+    batch.count = count;
+    batch.encode = true;
+    if (archive == NULL) {
+        return run_batch(&batch, options);
+    }
+    if (options->legacy) {
+        fprintf(stderr, "legacy files cannot go in an archive\n");
+        return -1;
+    }
+    file = open(archive, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (file == -1) {
+        perror(archive);
+        return -1;
+    }
+    batch.members = calloc(count > 0 ? count : 1, sizeof(ArchiveMember));
+    batch.archive = buf_writer_open(file, options->bufferSize);
+    if (batch.members == NULL || batch.archive == NULL) {
+        perror("malloc");
+        result = -1;
+    } else if (write_archive_header(batch.archive) == -1) {
+        perror("write");
+        result = -1;
+    } else {
+        for (i = 0; i < count; i++) {
+            batch.members[i].name = paths[i];
+        }
+        result = run_batch(&batch, options);
+        /* files that failed are left out of the contents */
+        count = 0;
+        for (i = 0; i < batch.count; i++) {
+            if (batch.members[i].codedOffset != 0) {
+                batch.members[count++] = batch.members[i];
+            }
+        }
+        if (write_archive_contents(batch.archive, batch.members,
+                                    count) == -1) {
+            perror("write");
+            result = -1;
+        }
+    }
+    if (buf_writer_close(batch.archive) == -1) {
+        perror("write");
+        result = -1;
+    }
+    free(batch.members);
+    close(file);
+    return result;
+}
+
+/* decode each of count files named something.huf to something, on
+   options->threads files at once */
+int huff_decode_batch(const HuffOptions* options, char* const paths[],
+                        size_t count) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.paths = paths;
+    batch.count = count;
+    batch.encode = false;
+    return run_batch(&batch, options);
+}
+
+/* decode every file in archive to the name it was coded from, on
+   options->threads files at once */
+int huff_extract_archive(const HuffOptions* options, const char* archive) {
+    Batch batch;
+    BufReader *in;
+    int file, result;
+
+    file = open(archive, O_RDONLY);
+    if (file == -1) {
+        perror(archive);
+        return -1;
+    }
+    in = buf_reader_map(file, 0);
+    if (in == NULL) {
+        fprintf(stderr, "%s: not an archive\n", archive);
+        close(file);
+        return -1;
+    }
+    memset(&batch, 0, sizeof(batch));
+    result = read_archive_contents(in, &batch.members, &batch.count);
+    if (result == 0) {
+        batch.source = in->data;
+        result = run_batch(&batch, options);
+    }
+    free_archive_contents(batch.members, batch.count);
+    buf_reader_close(in);
+    close(file);
+    return result;
+}
@@ -0,0 +1,908 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./block.h"
+#include "./ans.h"
+#include "./checksum.h"
+#include "./libhuffman.h"
+#include "./stats.h"
+
+#define RUN_SAMPLE_SIZE 4096 /* bytes looked at for runs before all are */
+#define PAIR_MIN_COUNT 16 /* fewest times a pair occurs to get a symbol */
+
+
+/* most bytes a block of n characters can be coded into, including the
+   room a BitWriter keeps for its 8-byte stores, a padding byte per
+   stream and a checksum; optimal codes never average more than 8 bits
+   per character */
+size_t encoded_block_bound(size_t n) {
+    return n + MAX_BLOCK_HEADER_SIZE + MAX_STREAMS + BLOCK_CHECKSUM_SIZE + 
+            16;
+}
+
+/* choose canonical codes of at most maxLength bits for a histogram and
+   fill in the rest of the block header */
+int plan_block(const uint64_t histogram[], int maxLength,
+                BlockHeader* block) {
+    int i, codeLength;
+    uint64_t charCount;
+    HuffTree tree;
+
+    if (create_hufftree(histogram, &tree) != 0) {
+        perror("tree creation");
+        return -1;
+    }
+    codeLength = build_code_table(&tree, block->codes);
+    block->loneSymbol = -1;
+    if (tree.leafCount == 1) { /* one-character block, codes have length 0 */
+        block->loneSymbol = tree.nodes[tree.root].asciiValue;
+    }
+    if (codeLength > maxLength && 
+        limit_code_lengths(histogram, block->codes, maxLength) != 0) {
+        fprintf(stderr, "characters do not fit in %d-bit codes\n", 
+                maxLength);
+        return -1;
+    }
+    /* canonical codes have the same lengths, so only lengths are sent */
+    assign_canonical_codes(block->codes);
+
+    charCount = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        charCount += histogram[i];
+    }
+    block->bodyBits = encoded_body_bits(histogram, block->codes);
+    block->type = BLOCK_HUFFMAN;
+    block->charCount = charCount;
+    block->keepCount = charCount;
+    block->bodyLength = (block->bodyBits + 7) / 8;
+    block->streamCount = 1;
+    block->maxLength = codeLength < maxLength ? codeLength : maxLength;
+    return 0;
+}
+
+/* turn a planned block into a streams block given the histogram of each
+   stream's run of characters */
+static void plan_streams(uint64_t histograms[][ASCII_TABLE_LENGTH],
+                            int streams, BlockHeader* block) {
+    int k;
+    uint64_t bits, bodyLength = 0;
+    for (k = 0; k < streams; k++) {
+        bits = encoded_body_bits(histograms[k], block->codes);
+        block->streamLengths[k] = (bits + 7) / 8;
+        bodyLength += block->streamLengths[k];
+    }
+    block->type = BLOCK_STREAMS;
+    block->streamCount = streams;
+    block->bodyLength = bodyLength;
+}
+
+/* pairs by count, most frequent first */
+static int compare_pairs(const void* a, const void* b) {
+    const uint64_t *left = a, *right = b;
+    if (left[0] != right[0]) {
+        return left[0] < right[0] ? 1 : -1;
+    }
+    return left[1] < right[1] ? -1 : left[1] > right[1];
+}
+
+/* plan a pair block for n bytes with the given histogram: the byte
+   values the block never uses stand for its most frequent pairs, so a
+   symbol can code two characters. The symbols are left in a buffer at
+   *symbols for the caller to code and free. Returns 1 without a plan
+   when the block has no spare byte values or no frequent pairs */
+static int plan_pairs(const unsigned char* data, size_t n, 
+                        const uint64_t histogram[], int maxLength,
+                        BlockHeader* block, unsigned char** symbols) {
+    uint64_t symbolHistogram[ASCII_TABLE_LENGTH];
+    unsigned char spare[ASCII_TABLE_LENGTH];
+    uint64_t *counts, (*chosen)[2], pairOf[ASCII_TABLE_LENGTH];
+    size_t i, k, candidates = 0;
+    int s, spareCount = 0, pairCount, result;
+
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        if (histogram[s] == 0) {
+            spare[spareCount++] = s;
+        }
+    }
+    if (spareCount == 0 || n < 2 * PAIR_MIN_COUNT) {
+        return 1;
+    }
+    counts = calloc(1 << 16, sizeof(uint64_t));
+    chosen = malloc((1 << 16) * sizeof(chosen[0]));
+    *symbols = malloc(n);
+    if (counts == NULL || chosen == NULL || *symbols == NULL) {
+        perror("malloc");
+        free(counts);
+        free(chosen);
+        free(*symbols);
+        return -1;
+    }
+    for (i = 0; i + 1 < n; i++) {
+        counts[(data[i] << 8) | data[i + 1]]++;
+    }
+    for (i = 0; i < 1 << 16; i++) {
+        if (counts[i] >= PAIR_MIN_COUNT) {
+            chosen[candidates][0] = counts[i];
+            chosen[candidates++][1] = i;
+        }
+    }
+    qsort(chosen, candidates, sizeof(chosen[0]), compare_pairs);
+    if (candidates > (size_t)spareCount) {
+        candidates = spareCount;
+    }
+
+    /* counts turns into the symbol plus 1 of each chosen pair, and the
+       bytes are parsed left to right taking a pair wherever one starts */
+    memset(counts, 0, (1 << 16) * sizeof(uint64_t));
+    for (i = 0; i < candidates; i++) {
+        counts[chosen[i][1]] = spare[i] + 1;
+    }
+    for (i = 0, k = 0; i + 1 < n; k++) {
+        s = counts[(data[i] << 8) | data[i + 1]];
+        if (s != 0) {
+            (*symbols)[k] = s - 1;
+            i += 2;
+        } else {
+            (*symbols)[k] = data[i++];
+        }
+    }
+    if (i < n) {
+        (*symbols)[k++] = data[i];
+    }
+    memset(symbolHistogram, 0, sizeof(symbolHistogram));
+    count_bytes(symbolHistogram, *symbols, k);
+
+    /* pairs the parse never took, since others overlapped them, are
+       dropped */
+    memset(pairOf, 0, sizeof(pairOf));
+    for (i = 0; i < candidates; i++) {
+        if (symbolHistogram[spare[i]] > 0) {
+            pairOf[spare[i]] = chosen[i][1] + 1;
+        }
+    }
+    free(counts);
+    free(chosen);
+    pairCount = 0;
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        if (pairOf[s] != 0) {
+            block->pairs[pairCount][0] = s;
+            block->pairs[pairCount][1] = (pairOf[s] - 1) >> 8;
+            block->pairs[pairCount++][2] = pairOf[s] - 1;
+        }
+    }
+    result = pairCount == 0 ? 1 : 
+                plan_block(symbolHistogram, maxLength, block);
+    if (result == 0 && block->loneSymbol != -1) {
+        result = 1; /* one symbol over and over is left to runs */
+    }
+    if (result != 0) {
+        free(*symbols);
+        *symbols = NULL;
+        return result;
+    }
+    block->type = BLOCK_PAIRS;
+    block->charCount = n;
+    block->keepCount = n;
+    block->codedCount = k;
+    block->pairCount = pairCount;
+    return 0;
+}
+
+/* bytes a run of length run takes in a run block */
+static size_t run_size(size_t run) {
+    size_t size = 2;
+    for (run--; run >= 0x80; run >>= 7) {
+        size++;
+    }
+    return size;
+}
+
+/* bytes of the run block body for n bytes, stopping early once it is
+   past limit */
+static size_t runs_length(const unsigned char* data, size_t n, 
+                            size_t limit) {
+    size_t i = 0, run, length = 0;
+    while (i < n && length <= limit) {
+        for (run = 1; i + run < n && data[i + run] == data[i]; run++) {
+        }
+        length += run_size(run);
+        i += run;
+    }
+    return length;
+}
+
+/* write n bytes as runs */
+static int encode_runs(const unsigned char* data, size_t n, 
+                        BufWriter* out) {
+    unsigned char pair[1 + 10];
+    size_t i = 0, run, left;
+    int length;
+    while (i < n) {
+        for (run = 1; i + run < n && data[i + run] == data[i]; run++) {
+        }
+        pair[0] = data[i];
+        length = 1;
+        for (left = run - 1; left >= 0x80; left >>= 7) {
+            pair[length++] = (left & 0x7f) | 0x80;
+        }
+        pair[length++] = left;
+        if (buf_write(out, pair, length) == -1) {
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/* code n bytes as a stored or run block instead of block, planned with
+   a huffman code, when that is smaller; returns 1 when block is best */
+static int encode_plain_block(const unsigned char* data, size_t n, 
+                                const BlockHeader* block, BufWriter* out, 
+                                uint64_t* bodyBits) {
+    BlockHeader plain;
+    size_t best, runs, sample, runHeader;
+    int result;
+
+    /* a one-character block is already a fill */
+    best = block_header_size(block) + block->bodyLength;
+    if (block->loneSymbol != -1) {
+        return 1;
+    }
+    /* the most a run block header takes for runs that beat best */
+    plain.type = BLOCK_RLE;
+    plain.charCount = n;
+    plain.bodyLength = best;
+    runHeader = block_header_size(&plain);
+    plain.type = BLOCK_STORED;
+    plain.bodyLength = n;
+    if (block_header_size(&plain) + n < best) {
+        best = block_header_size(&plain) + n;
+    } else {
+        plain.type = BLOCK_HUFFMAN;
+    }
+    /* runs are counted in full only when the start of the block looks
+       like it has enough of them, and the count gives up once runs lose */
+    sample = n < RUN_SAMPLE_SIZE ? n : RUN_SAMPLE_SIZE;
+    runs = runs_length(data, sample, SIZE_MAX);
+    if ((uint64_t)runs * n < (uint64_t)(best - runHeader) * sample) {
+        runs = runs_length(data, n, best - runHeader);
+    } else {
+        runs = best;
+    }
+    if (runHeader + runs < best) {
+        plain.type = BLOCK_RLE;
+        plain.bodyLength = runs;
+    }
+    if (plain.type == BLOCK_HUFFMAN) {
+        return 1;
+    }
+
+    if (write_block_header(out, FORMAT_VERSION, &plain) == -1) {
+        perror("header write");
+        return -1;
+    }
+    result = plain.type == BLOCK_STORED ? buf_write(out, data, n) :
+                                            encode_runs(data, n, out);
+    if (result == -1) {
+        perror("write body");
+        return -1;
+    }
+    if (bodyBits != NULL) {
+        *bodyBits = (uint64_t)plain.bodyLength * 8;
+    }
+    return 0;
+}
+
+/* code n bytes as a shared block with the codes of a shared table, with
+   no histogram or tree. The header needs the body length, so the body is
+   coded into memory first, in room for n bytes. Returns 1 without
+   writing anything when the table codes the bytes in more than 8 bits
+   each, so they are better off with codes of their own */
+static int encode_shared_block(const unsigned char* data, size_t n,
+                                const HuffCode codes[], BufWriter* out, 
+                                uint64_t* bodyBits) {
+    uint64_t histogram[ASCII_TABLE_LENGTH];
+    BlockHeader block;
+    BitWriter writer;
+    BufWriter *body;
+    unsigned char *scratch;
+    uint64_t bits;
+    double clock;
+    int i, maxLength = 0, result = -1;
+
+    scratch = malloc(n + 2 * IO_BUFFER_SLACK);
+    body = scratch == NULL ? NULL : 
+            buf_writer_wrap(scratch, n + IO_BUFFER_SLACK);
+    if (body == NULL) {
+        perror("malloc");
+        free(scratch);
+        return -1;
+    }
+    clock = stats_clock();
+    bit_writer_init(&writer, body);
+    if (encode_buffer(codes, data, n, &writer) == -1) { /* out of room */
+        result = 1;
+        goto done;
+    }
+    bits = buf_position(body) * 8 + writer.count;
+    if (bits > (uint64_t)n * 8 || bit_writer_finish(&writer) == -1) {
+        result = 1;
+        goto done;
+    }
+    stats_phase(STAT_ENCODE, clock);
+    /* the histogram is only counted for the entropy of the report */
+    if (stats_active()) {
+        for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+            if (codes[i].length > maxLength) {
+                maxLength = codes[i].length;
+            }
+        }
+        clock = stats_clock();
+        memset(histogram, 0, sizeof(histogram));
+        count_bytes(histogram, data, n);
+        stats_phase(STAT_HISTOGRAM, clock);
+        stats_coded(histogram, maxLength, bits);
+    }
+
+    block.type = BLOCK_SHARED;
+    block.charCount = n;
+    block.bodyLength = body->count;
+    if (write_block_header(out, FORMAT_VERSION, &block) == -1) {
+        perror("header write");
+        goto done;
+    }
+    if (buf_write(out, scratch, body->count) == -1) {
+        perror("write body");
+        goto done;
+    }
+    if (bodyBits != NULL) {
+        *bodyBits = bits;
+    }
+    result = 0;
+done:
+    buf_writer_close(body);
+    free(scratch);
+    return result;
+}
+
+/* code n bytes as a tANS block, or stored or as runs when that is
+   smaller. Given the huffman or pair block planned for them, returns 1
+   without writing anything when that is no larger */
+static int encode_ans_block(const unsigned char* data, size_t n,
+                            const uint64_t histogram[],
+                            const BlockHeader* huffman, BufWriter* out, 
+                            uint64_t* bodyBits) {
+    BlockHeader block;
+    unsigned char *body;
+    size_t capacity, length, huffmanSize = 0;
+    double clock;
+    int result;
+
+    clock = stats_clock();
+    block.type = BLOCK_ANS;
+    block.charCount = n;
+    block.keepCount = n;
+    block.loneSymbol = -1;
+    block.streamCount = 1;
+    block.tableLog = ans_table_log(histogram);
+    if (ans_normalize(histogram, block.tableLog, block.counts) == -1) {
+        fprintf(stderr, "characters do not fit in a tANS table\n");
+        return -1;
+    }
+    stats_phase(STAT_TREE, clock);
+    /* the estimate is within a few bytes of the body, so a huffman block
+       that beats it is kept without coding */
+    if (huffman != NULL) {
+        huffmanSize = block_header_size(huffman) + huffman->bodyLength;
+        if (block_header_size(&block) + ans_body_bits(histogram, 
+                block.counts, block.tableLog) / 8 >= huffmanSize) {
+            return 1;
+        }
+    }
+
+    /* coded backwards into memory; a body that does not fit in the
+       bytes' own length loses to storing them */
+    capacity = n + 8;
+    body = malloc(capacity);
+    if (body == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    clock = stats_clock();
+    length = ans_encode(block.counts, block.tableLog, data, n, body, 
+                        capacity);
+    stats_phase(STAT_ENCODE, clock);
+    block.bodyLength = length > 0 ? length : capacity;
+    block.bodyBits = (uint64_t)block.bodyLength * 8;
+    if (huffman != NULL && 
+        block_header_size(&block) + block.bodyLength >= huffmanSize) {
+        free(body);
+        return 1;
+    }
+    stats_coded(histogram, 0, block.bodyBits); /* no prefix codes */
+    clock = stats_clock();
+    result = encode_plain_block(data, n, &block, out, bodyBits);
+    if (result == 1) {
+        result = 0;
+        if (write_block_header(out, FORMAT_VERSION, &block) == -1) {
+            perror("header write");
+            result = -1;
+        } else if (buf_write(out, body + capacity - length, length) == -1) {
+            perror("write body");
+            result = -1;
+        } else if (bodyBits != NULL) {
+            *bodyBits = block.bodyBits;
+        }
+    }
+    stats_phase(STAT_ENCODE, clock);
+    free(body);
+    return result;
+}
+
+/* code n bytes as the pair block planned for them, whose symbols are
+   at symbols, or stored or as runs when that is smaller */
+static int encode_pairs_block(const unsigned char* data, size_t n,
+                                const uint64_t histogram[],
+                                const BlockHeader* block,
+                                const unsigned char* symbols, 
+                                BufWriter* out, uint64_t* bodyBits) {
+    BitWriter writer;
+    double clock;
+    int result;
+    stats_coded(histogram, block->maxLength, block->bodyBits);
+    clock = stats_clock();
+    result = encode_plain_block(data, n, block, out, bodyBits);
+    stats_phase(STAT_ENCODE, clock);
+    if (result != 1) {
+        return result;
+    }
+    if (write_block_header(out, FORMAT_VERSION, block) == -1) {
+        perror("header write");
+        return -1;
+    }
+    clock = stats_clock();
+    bit_writer_init(&writer, out);
+    if (encode_buffer(block->codes, symbols, block->codedCount, 
+                        &writer) == -1 ||
+        bit_writer_finish(&writer) == -1) {
+        perror("write body");
+        return -1;
+    }
+    stats_phase(STAT_ENCODE, clock);
+    if (bodyBits != NULL) {
+        *bodyBits = block->bodyBits;
+    }
+    return 0;
+}
+
+/* code n bytes held in memory as one block: header then padded body,
+   split into streams interleaved streams when that is more than 1, or
+   a shared block when shared codes are given and fit the bytes. codec
+   picks huffman, pair or tANS coding, or whichever codes the block
+   smaller */
+static int code_block(const unsigned char* data, size_t n, int maxLength,
+                        int streams, int codec, const HuffCode shared[], 
+                        BufWriter* out, uint64_t* bodyBits) {
+    uint64_t histogram[ASCII_TABLE_LENGTH];
+    uint64_t streamHistograms[MAX_STREAMS][ASCII_TABLE_LENGTH];
+    BlockHeader block, pairBlock, *best;
+    unsigned char *symbols = NULL;
+    BitWriter writer;
+    size_t run, start[MAX_STREAMS + 1];
+    double clock;
+    int i, k, result;
+
+    if (shared != NULL && 
+        (result = encode_shared_block(data, n, shared, out, bodyBits)) != 1) {
+        return result;
+    }
+
+    /* stream k codes characters start[k] up to start[k + 1] */
+    run = n / streams + (n % streams != 0);
+    clock = stats_clock();
+    memset(histogram, 0, sizeof(histogram));
+    memset(streamHistograms, 0, streams * sizeof(streamHistograms[0]));
+    for (k = 0; k < streams; k++) {
+        start[k] = run * k < n ? run * k : n;
+        start[k + 1] = n - start[k] > run ? start[k] + run : n;
+        count_bytes(streamHistograms[k], data + start[k],
+                    start[k + 1] - start[k]);
+        for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+            histogram[i] += streamHistograms[k][i];
+        }
+    }
+    stats_phase(STAT_HISTOGRAM, clock);
+    clock = stats_clock();
+    if (plan_block(histogram, maxLength, &block) == -1) {
+        return -1;
+    }
+    stats_phase(STAT_TREE, clock);
+    /* a one-character block is a fill whichever the codec; pairs are
+       kept only when they make the block smaller */
+    best = &block;
+    if ((codec == HUFF_CODEC_PAIRS || codec == HUFF_CODEC_BEST) && 
+        block.loneSymbol == -1) {
+        clock = stats_clock();
+        result = plan_pairs(data, n, histogram, maxLength, &pairBlock, 
+                            &symbols);
+        stats_phase(STAT_TREE, clock);
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0 && block_header_size(&pairBlock) + 
+                pairBlock.bodyLength < block_header_size(&block) + 
+                block.bodyLength) {
+            best = &pairBlock;
+        }
+    }
+    if ((codec == HUFF_CODEC_ANS || codec == HUFF_CODEC_BEST) && 
+        block.loneSymbol == -1 &&
+        (result = encode_ans_block(data, n, histogram, 
+                    codec == HUFF_CODEC_BEST ? best : NULL, out, 
+                    bodyBits)) != 1) {
+        free(symbols);
+        return result;
+    }
+    if (best == &pairBlock) {
+        result = encode_pairs_block(data, n, histogram, &pairBlock, symbols,
+                                    out, bodyBits);
+        free(symbols);
+        return result;
+    }
+    free(symbols);
+    stats_coded(histogram, block.maxLength, block.bodyBits);
+    /* a one-character block has no body to split */
+    if (streams > 1 && block.loneSymbol == -1) {
+        plan_streams(streamHistograms, streams, &block);
+    }
+    /* already compressed input is stored, long runs are counted */
+    clock = stats_clock();
+    result = encode_plain_block(data, n, &block, out, bodyBits);
+    stats_phase(STAT_ENCODE, clock);
+    if (result != 1) {
+        return result;
+    }
+    if (write_block_header(out, FORMAT_VERSION, &block) == -1) {
+        perror("header write");
+        return -1;
+    }
+    if (block.streamCount == 1) {
+        start[1] = n;
+    }
+    clock = stats_clock();
+    for (k = 0; k < block.streamCount; k++) {
+        bit_writer_init(&writer, out);
+        if (encode_buffer(block.codes, data + start[k], 
+                            start[k + 1] - start[k], &writer) == -1 ||
+            bit_writer_finish(&writer) == -1) {
+            perror("write body");
+            return -1;
+        }
+    }
+    stats_phase(STAT_ENCODE, clock);
+    if (bodyBits != NULL) {
+        *bodyBits = block.bodyBits;
+    }
+    return 0;
+}
+
+/* code n bytes held in memory as one block with codec, one of the
+   HUFF_CODEC values, followed by the checksum of the bytes when checksum
+   is set; bodyBits, if not NULL, receives the body length before
+   padding */
+int encode_block(const unsigned char* data, size_t n, int maxLength,
+                    int streams, int codec, const HuffCode shared[], 
+                    bool checksum, BufWriter* out, uint64_t* bodyBits) {
+    uint32_t crc;
+    double clock;
+    if (code_block(data, n, maxLength, streams, codec, shared, out, 
+                    bodyBits) == -1) {
+        return -1;
+    }
+    if (!checksum) {
+        return 0;
+    }
+    clock = stats_clock();
+    crc = crc32c(0, data, n);
+    stats_phase(STAT_CHECKSUM, clock);
+    if (write_block_checksum(out, crc) == -1) {
+        perror("write checksum");
+        return -1;
+    }
+    return 0;
+}
+
+/* turn the symbols of a pair block, decoded into the start of dst, into
+   its characters in place. It runs from the back, where the characters
+   outgrow the symbols, reading each symbol before its two bytes are
+   stored; a lone character stores the byte before it too, which an
+   earlier symbol writes again. -1 when the symbols do not make
+   charCount characters */
+static int expand_pairs(const BlockHeader* block, unsigned char* dst) {
+    unsigned char expand[ASCII_TABLE_LENGTH][2];
+    unsigned char lengths[ASCII_TABLE_LENGTH];
+    size_t i = block->codedCount, end = block->charCount;
+    int s, next;
+    for (s = 0; s < ASCII_TABLE_LENGTH; s++) {
+        expand[s][0] = 0;
+        expand[s][1] = s;
+        lengths[s] = 1;
+    }
+    for (s = 0; s < block->pairCount; s++) {
+        expand[block->pairs[s][0]][0] = block->pairs[s][1];
+        expand[block->pairs[s][0]][1] = block->pairs[s][2];
+        lengths[block->pairs[s][0]] = 2;
+    }
+    if (i == 0) {
+        return end == 0 ? 0 : -1;
+    }
+    /* symbol i, read as next, leaves its characters at end, which stays
+       past every symbol not yet read */
+    next = dst[--i];
+    while (i > 0) {
+        s = next;
+        next = dst[i - 1];
+        if (end - i < lengths[s]) {
+            return -1;
+        }
+        dst[end - 2] = expand[s][0];
+        dst[end - 1] = expand[s][1];
+        end -= lengths[s];
+        i--;
+    }
+    if (end != lengths[next]) {
+        return -1;
+    }
+    dst[end - 1] = expand[next][1];
+    if (end == 2) {
+        dst[0] = expand[next][0];
+    }
+    return 0;
+}
+
+/* decode a block whose body is all taken into memory, a streams or pair
+   block, a plain one that is already there, or with ans a tANS block;
+   the characters are decoded straight into the writer when they fit */
+static int decode_whole_body(const BlockHeader* block, 
+                                const DecodeTable* table, 
+                                const AnsDecodeTable* ans,
+                                BufReader* in, BufWriter* out) {
+    const unsigned char *body;
+    unsigned char *bodyCopy = NULL, *scratch = NULL, *dst;
+    ssize_t bodyRead;
+    int result;
+
+    bodyRead = buf_view(in, &body, block->bodyLength);
+    if (bodyRead == -1) { /* input is not in memory, copy the body */
+        bodyCopy = malloc(block->bodyLength);
+        if (bodyCopy == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        bodyRead = buf_read(in, bodyCopy, block->bodyLength);
+        body = bodyCopy;
+    }
+    if (bodyRead != (ssize_t)block->bodyLength) {
+        fprintf(stderr, "truncated block body\n");
+        free(bodyCopy);
+        return -1;
+    }
+    if (out->size - out->count < block->charCount && buf_flush(out) == -1) {
+        perror("write");
+        free(bodyCopy);
+        return -1;
+    }
+    if (out->size - out->count >= block->charCount) {
+        dst = out->data + out->count;
+    } else if ((dst = scratch = malloc(block->charCount)) == NULL) {
+        perror("malloc");
+        free(bodyCopy);
+        return -1;
+    }
+    if (ans != NULL) {
+        result = ans_decode(ans, body, block->bodyLength, dst, 
+                            block->charCount);
+        if (result == -1) {
+            fprintf(stderr, "corrupt tANS block\n");
+        }
+    } else if (block->type == BLOCK_PAIRS) {
+        result = decode_streams(table, 1, body, block->streamLengths,
+                                block->codedCount, dst);
+        if (result == 0 && (result = expand_pairs(block, dst)) == -1) {
+            fprintf(stderr, "corrupt pair block\n");
+        }
+    } else {
+        result = decode_streams(table, block->streamCount, body, 
+                                block->streamLengths, block->charCount, 
+                                dst);
+    }
+    if (result == 0 && scratch == NULL) {
+        out->count += block->keepCount;
+    } else if (result == 0 && 
+                buf_write(out, scratch, block->keepCount) == -1) {
+        perror("write");
+        result = -1;
+    }
+    free(scratch);
+    free(bodyCopy);
+    return result;
+}
+
+/* copy the characters of a stored block */
+static int decode_stored(const BlockHeader* block, BufReader* in, 
+                            BufWriter* out) {
+    uint64_t keep = block->keepCount;
+    ssize_t available;
+    while (keep > 0) {
+        available = buf_fill(in);
+        if (available <= 0) {
+            fprintf(stderr, "truncated block body\n");
+            return -1;
+        }
+        if ((size_t)available > keep) {
+            available = keep;
+        }
+        if (buf_write(out, in->data + in->next, available) == -1) {
+            perror("write");
+            return -1;
+        }
+        in->next += available;
+        keep -= available;
+    }
+    if (buf_skip(in, block->charCount - block->keepCount) == -1) {
+        fprintf(stderr, "truncated block body\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* expand the runs of a run block, stopping at keepCount characters */
+static int decode_runs(const BlockHeader* block, BufReader* in, 
+                        BufWriter* out) {
+    uint64_t left = block->charCount, keep = block->keepCount, run;
+    uint64_t read = 0;
+    unsigned char symbol, group;
+    int shift;
+    while (left > 0 && keep > 0) {
+        if (read == block->bodyLength || buf_read(in, &symbol, 1) != 1) {
+            fprintf(stderr, "truncated block body\n");
+            return -1;
+        }
+        read++;
+        run = 0;
+        shift = 0;
+        do {
+            if (read == block->bodyLength || buf_read(in, &group, 1) != 1 ||
+                shift > 63) {
+                fprintf(stderr, "corrupt run block\n");
+                return -1;
+            }
+            read++;
+            run |= (uint64_t)(group & 0x7f) << shift;
+            shift += 7;
+        } while (group & 0x80);
+        if (run >= left) { /* a run of run + 1 */
+            fprintf(stderr, "corrupt run block\n");
+            return -1;
+        }
+        left -= ++run;
+        if (decode_fill(symbol, run < keep ? run : keep, out) == -1) {
+            return -1;
+        }
+        keep -= run < keep ? run : keep;
+    }
+    if (keep > 0) {
+        fprintf(stderr, "corrupt run block\n");
+        return -1;
+    }
+    /* the runs past the range are not needed */
+    if (buf_skip(in, block->bodyLength - read) == -1) {
+        fprintf(stderr, "truncated block body\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* decode a tANS block, whose states are dealt out from its counts */
+static int decode_ans_block(const BlockHeader* block, BufReader* in, 
+                            BufWriter* out) {
+    AnsDecodeTable table;
+    double clock;
+    int result;
+    clock = stats_clock();
+    if (ans_build_decode_table(block->counts, block->tableLog, 
+                                &table) == -1) {
+        fprintf(stderr, "corrupt tANS count table\n");
+        return -1;
+    }
+    stats_phase(STAT_TABLE, clock);
+    clock = stats_clock();
+    result = decode_whole_body(block, NULL, &table, in, out);
+    stats_phase(STAT_DECODE, clock);
+    return result;
+}
+
+/* decode the body of a block whose header was just read */
+static int decode_contents(const BlockHeader* block, DecodeTable* table, 
+                            const DecodeTable* shared, BufReader* in, 
+                            BufWriter* out) {
+    const DecodeTable *lookup = table;
+    double clock;
+    int result;
+    stats_decoded(block->charCount, block->type == BLOCK_SHARED && 
+                    shared != NULL ? shared->maxLength : block->maxLength,
+                    (uint64_t)block->bodyLength * 8);
+    if (block->type == BLOCK_STORED || block->type == BLOCK_RLE) {
+        clock = stats_clock();
+        result = block->type == BLOCK_STORED ? 
+                    decode_stored(block, in, out) : 
+                    decode_runs(block, in, out);
+        stats_phase(STAT_DECODE, clock);
+        return result;
+    }
+    if (block->type == BLOCK_ANS) {
+        return decode_ans_block(block, in, out);
+    }
+    if (block->type == BLOCK_SHARED) { /* its table is built already */
+        if (shared == NULL) {
+            fprintf(stderr, "shared block in a file without a table\n");
+            return -1;
+        }
+        lookup = shared;
+    } else if (block->symbolCount == 1) { /* no body, just one character */
+        clock = stats_clock();
+        result = decode_fill(block->loneSymbol, block->keepCount, out);
+        stats_phase(STAT_DECODE, clock);
+        return result;
+    } else if (block->charCount > 0 && block->symbolCount == 0) {
+        fprintf(stderr, "block has characters but no codes\n");
+        return -1;
+    } else {
+        clock = stats_clock();
+        if (build_decode_table(block->codes, table) == -1) {
+            fprintf(stderr, "corrupt code length table\n");
+            return -1;
+        }
+        stats_phase(STAT_TABLE, clock);
+    }
+    clock = stats_clock();
+    if (block->type == BLOCK_STREAMS || block->type == BLOCK_PAIRS ||
+        (in->borrowed && block->charCount <= out->size)) {
+        result = decode_whole_body(block, lookup, NULL, in, out);
+    } else {
+        result = decode_body(lookup, block->keepCount, block->bodyLength,
+                                in, out);
+    }
+    stats_phase(STAT_DECODE, clock);
+    return result;
+}
+
+/* decode the body of a block whose header was just read; table is
+   scratch space for the block's lookup table, shared the lookup table of
+   the file's shared table, NULL when it has none. With checksum the
+   block's checksum follows its body and is checked against what was
+   decoded, unless a range cut the block short */
+int decode_block(const BlockHeader* block, DecodeTable* table, 
+                    const DecodeTable* shared, bool checksum, 
+                    BufReader* in, BufWriter* out) {
+    uint32_t expected, actual;
+    int result;
+    if (!checksum) {
+        return decode_contents(block, table, shared, in, out);
+    }
+    buf_checksum_begin(out);
+    result = decode_contents(block, table, shared, in, out);
+    actual = buf_checksum_end(out);
+    if (result == -1 || block->keepCount < block->charCount) {
+        return result;
+    }
+    if (read_block_checksum(in, &expected) == -1) {
+        fprintf(stderr, "truncated block checksum\n");
+        return -1;
+    }
+    if (actual != expected) {
+        fprintf(stderr, "block checksum mismatch, file is corrupt\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdbool.h>
+#include "./format.h"
+
+#define DEFAULT_BLOCK_SIZE (1 << 20) /* input bytes per block when streaming */
+#define MAX_BLOCK_HEADER_SIZE 1008 /* pair block header with every pair */
+
+size_t encoded_block_bound(size_t n);
+int plan_block(const uint64_t histogram[], int maxLength,
+                BlockHeader* block);
+int encode_block(const unsigned char* data, size_t n, int maxLength,
+                    int streams, int codec, const HuffCode shared[], 
+                    bool checksum, BufWriter* out, uint64_t* bodyBits);
+int decode_block(const BlockHeader* block, DecodeTable* table, 
+                    const DecodeTable* shared, bool checksum, 
+                    BufReader* in, BufWriter* out);
+
+#endif
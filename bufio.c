@@ -0,0 +1,845 @@
+#define _DEFAULT_SOURCE /* madvise, posix_fallocate */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./bufio.h"
+#include "./checksum.h"
+#include "./stats.h"
+
+
+/* read that retries when interrupted by a signal */
+static ssize_t read_retry(int file, void* dst, size_t n) {
+    ssize_t bytesRead;
+    double start = stats_clock();
+    do {
+        bytesRead = read(file, dst, n);
+    } while (bytesRead == -1 && errno == EINTR);
+    stats_io(STAT_READ, start, bytesRead > 0 ? bytesRead : 0);
+    return bytesRead;
+}
+
+/* write all n bytes, looping over short writes and signals */
+static int write_all(int file, const unsigned char* src, size_t n) {
+    ssize_t written;
+    double start;
+    while (n > 0) {
+        start = stats_clock();
+        written = write(file, src, n);
+        stats_io(STAT_WRITE, start, written > 0 ? written : 0);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        src += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/* buffers passed between the caller and an I/O thread, which reads
+   ahead into them or writes them out behind the caller; the n-th buffer
+   read or handed over to be written is buffers[n % depth] */
+typedef struct IoRing {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* a buffer was filled, given back, handed
+                               over or written, or the thread is done */
+    int file;
+    unsigned char **buffers;
+    size_t *starts; /* first byte of each buffer to write */
+    size_t *lengths; /* bytes read into, or to write from, each buffer */
+    size_t size; /* capacity of each buffer */
+    int depth;
+    unsigned long produced; /* buffers read, or handed over to write */
+    unsigned long consumed; /* buffers given back, or written */
+    int held; /* the caller is reading buffer consumed % depth */
+    unsigned char *joined; /* buf_ensure's bytes from two buffers */
+    int done; /* the reader saw end of file or an error */
+    int error; /* errno of a failed read or write, 0 if none */
+    int stop; /* the thread is to leave */
+    HuffStats *stats; /* record of the call the thread works for */
+} IoRing;
+
+/* reader thread: fill buffers until end of file, error or stop */
+static void* read_ahead(void* arg) {
+    IoRing *ring = arg;
+    ssize_t bytesRead;
+    int slot;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    stats_attach(ring->stats);
+    pthread_mutex_lock(&ring->lock);
+    while (!ring->stop && !ring->done) {
+        if (ring->produced - ring->consumed == (unsigned long)ring->depth) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+            continue;
+        }
+        slot = ring->produced % ring->depth;
+        pthread_mutex_unlock(&ring->lock);
+        /* a pipe may never have more, so the wait in read can be cut */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        bytesRead = read_retry(ring->file, ring->buffers[slot], ring->size);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&ring->lock);
+        if (bytesRead <= 0) {
+            ring->error = bytesRead == -1 ? errno : 0;
+            ring->done = 1;
+        } else {
+            ring->lengths[slot] = bytesRead;
+            ring->produced++;
+        }
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/* writer thread: write buffers in the order handed over until stopped
+   with none left; after an error the rest are dropped */
+static void* write_behind(void* arg) {
+    IoRing *ring = arg;
+    int slot, failed, result;
+    stats_attach(ring->stats);
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (ring->produced == ring->consumed && !ring->stop) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        if (ring->produced == ring->consumed) {
+            break;
+        }
+        slot = ring->consumed % ring->depth;
+        failed = ring->error != 0;
+        pthread_mutex_unlock(&ring->lock);
+        result = failed ? 0 : write_all(ring->file, 
+                        ring->buffers[slot] + ring->starts[slot],
+                        ring->lengths[slot]);
+        pthread_mutex_lock(&ring->lock);
+        if (result == -1) {
+            ring->error = errno;
+        }
+        ring->consumed++;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+static void ring_free(IoRing* ring) {
+    int i;
+    if (ring == NULL) {
+        return;
+    }
+    for (i = 0; ring->buffers != NULL && i < ring->depth; i++) {
+        free(ring->buffers[i]);
+    }
+    pthread_cond_destroy(&ring->changed);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->buffers);
+    free(ring->starts);
+    free(ring->lengths);
+    free(ring->joined);
+    free(ring);
+}
+
+/* ring of depth buffers of size bytes over file, NULL if out of memory */
+static IoRing* ring_new(int file, size_t size, int depth) {
+    IoRing *ring = calloc(1, sizeof(IoRing));
+    int i;
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    ring->buffers = calloc(depth, sizeof(unsigned char*));
+    ring->starts = calloc(depth, sizeof(size_t));
+    ring->lengths = calloc(depth, sizeof(size_t));
+    for (i = 0; ring->buffers != NULL && i < depth; i++) {
+        if ((ring->buffers[i] = malloc(size)) == NULL) {
+            break;
+        }
+    }
+    ring->depth = i;
+    if (i < depth || ring->starts == NULL || ring->lengths == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+    ring->file = file;
+    ring->size = size;
+    return ring;
+}
+
+/* start the thread from an empty ring, -1 if it cannot be */
+static int ring_start(IoRing* ring, void* (*run)(void*)) {
+    int result;
+    ring->produced = 0;
+    ring->consumed = 0;
+    ring->held = 0;
+    ring->done = 0;
+    ring->error = 0;
+    ring->stop = 0;
+    ring->stats = stats_current();
+    result = pthread_create(&ring->thread, NULL, run, ring);
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+/* make the thread leave, cutting short a read that waits on a pipe;
+   a writer thread first writes what it was handed */
+static void ring_stop(IoRing* ring, int cancel) {
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    if (cancel) {
+        pthread_cancel(ring->thread);
+    }
+    pthread_join(ring->thread, NULL);
+}
+
+/* wait for a read buffer past the one the caller holds; returns how
+   many there are, 0 at end of file, -1 with errno on a read error.
+   Called with the lock held */
+static int ring_wait(IoRing* ring) {
+    unsigned long ready;
+    while ((ready = ring->produced - ring->consumed - ring->held) == 0 &&
+            !ring->done) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    if (ready == 0 && ring->error != 0) {
+        errno = ring->error;
+        return -1;
+    }
+    return ready > 0;
+}
+
+/* give back the buffer being read and move to the next one; at end of
+   file the old bytes stay put for buf_rewind */
+static ssize_t ring_fill(BufReader* reader) {
+    IoRing *ring = reader->ring;
+    ssize_t length = 0;
+    int slot, ready;
+    pthread_mutex_lock(&ring->lock);
+    ready = ring_wait(ring);
+    if (ready == 1) {
+        ring->consumed += ring->held;
+        ring->held = 1;
+        slot = ring->consumed % ring->depth;
+        length = ring->lengths[slot];
+        reader->offset += reader->end;
+        reader->data = ring->buffers[slot];
+        reader->next = 0;
+        reader->end = length;
+        pthread_cond_broadcast(&ring->changed);
+    } else if (ready == 0) {
+        reader->eof = 1;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return ready == -1 ? -1 : length;
+}
+
+/* buf_ensure across buffers: the unread bytes and as many following
+   buffers as it takes are copied together, and those buffers given back */
+static ssize_t ring_ensure(BufReader* reader, size_t n) {
+    IoRing *ring = reader->ring;
+    size_t left = reader->end - reader->next;
+    int slot, ready = 1;
+    if (ring->joined == NULL && (ring->joined = malloc(2 * ring->size)) ==
+                                                                    NULL) {
+        return -1;
+    }
+    memmove(ring->joined, reader->data + reader->next, left);
+    reader->offset += reader->next;
+    pthread_mutex_lock(&ring->lock);
+    ring->consumed += ring->held;
+    ring->held = 0;
+    while (left < n && (ready = ring_wait(ring)) == 1) {
+        slot = ring->consumed % ring->depth;
+        memcpy(ring->joined + left, ring->buffers[slot], ring->lengths[slot]);
+        left += ring->lengths[slot];
+        ring->consumed++;
+    }
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    reader->data = ring->joined;
+    reader->next = 0;
+    reader->end = left;
+    if (ready == 0) {
+        reader->eof = 1;
+    }
+    return ready == -1 ? -1 : (ssize_t)left;
+}
+
+/* read again from file offset, once the thread has left */
+static int ring_restart(BufReader* reader, off_t offset) {
+    ring_stop(reader->ring, 1);
+    if (lseek(reader->file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    reader->data = reader->ring->buffers[0];
+    reader->next = 0;
+    reader->end = 0;
+    reader->offset = offset;
+    reader->eof = 0;
+    return ring_start(reader->ring, read_ahead);
+}
+
+/* hand the buffered bytes from skip on to the writer thread and take
+   the next buffer once it is written; a write error the thread met is
+   returned here, or by a later flush */
+static int ring_flush(BufWriter* writer, size_t skip) {
+    IoRing *ring = writer->ring;
+    int slot, error;
+    pthread_mutex_lock(&ring->lock);
+    if (writer->count > skip) {
+        slot = ring->produced % ring->depth;
+        ring->starts[slot] = skip;
+        ring->lengths[slot] = writer->count - skip;
+        ring->produced++;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    while (ring->produced - ring->consumed == (unsigned long)ring->depth) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    error = ring->error;
+    pthread_mutex_unlock(&ring->lock);
+    writer->data = ring->buffers[ring->produced % ring->depth];
+    writer->flushed += writer->count - skip;
+    writer->count = 0;
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* allocate reader with a buffer of size bytes */
+BufReader* buf_reader_open(int file, size_t size) {
+    BufReader* reader = malloc(sizeof(BufReader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->data = malloc(size);
+    if (reader->data == NULL) {
+        free(reader);
+        return NULL;
+    }
+    reader->file = file;
+    reader->size = size;
+    reader->next = 0;
+    reader->end = 0;
+    reader->offset = 0;
+    reader->eof = 0;
+    reader->borrowed = 0;
+    reader->mapped = 0;
+    reader->ring = NULL;
+    return reader;
+}
+
+/* reader over n bytes already in memory, which must outlive it */
+BufReader* buf_reader_wrap(const unsigned char* data, size_t n) {
+    BufReader* reader = malloc(sizeof(BufReader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->file = -1;
+    reader->data = (unsigned char*)data;
+    reader->size = n;
+    reader->next = 0;
+    reader->end = n;
+    reader->offset = 0;
+    reader->eof = 1;
+    reader->borrowed = 1;
+    reader->mapped = 0;
+    reader->ring = NULL;
+    return reader;
+}
+
+/* reader over a mapping of a whole regular file of at least minSize
+   bytes, so the kernels work on the page cache without read() copies;
+   returns NULL when the file cannot or should not be mapped, and the
+   caller falls back to buf_reader_open */
+BufReader* buf_reader_map(int file, size_t minSize) {
+    struct stat info;
+    BufReader* reader;
+    void *data;
+    if (fstat(file, &info) == -1 || !S_ISREG(info.st_mode) ||
+        info.st_size == 0 || (uintmax_t)info.st_size < minSize ||
+        (uintmax_t)info.st_size > SIZE_MAX) {
+        return NULL;
+    }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    /* hints only, the mapping works without them */
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(data, info.st_size, MADV_HUGEPAGE);
+#endif
+    reader = buf_reader_wrap(data, info.st_size);
+    if (reader == NULL) {
+        munmap(data, info.st_size);
+        return NULL;
+    }
+    reader->file = file;
+    reader->mapped = 1;
+    return reader;
+}
+
+/* make unread bytes available, returns their count, 0 at end of file */
+ssize_t buf_fill(BufReader* reader) {
+    ssize_t bytesRead;
+    if (reader->next < reader->end) {
+        return reader->end - reader->next;
+    }
+    if (reader->eof) {
+        return 0;
+    }
+    if (reader->ring != NULL) {
+        return ring_fill(reader);
+    }
+    bytesRead = read_retry(reader->file, reader->data, reader->size);
+    if (bytesRead <= 0) {
+        if (bytesRead == 0) {
+            reader->eof = 1; /* old bytes stay put for buf_rewind */
+        }
+        return bytesRead;
+    }
+    reader->offset += reader->end;
+    reader->next = 0;
+    reader->end = bytesRead;
+    return bytesRead;
+}
+
+/* copy up to n bytes into dst, short only at end of file */
+ssize_t buf_read(BufReader* reader, void* dst, size_t n) {
+    size_t done, chunk;
+    ssize_t available;
+    done = 0;
+    while (done < n) {
+        available = buf_fill(reader);
+        if (available <= 0) {
+            if (available == -1) {
+                return -1;
+            }
+            break;
+        }
+        chunk = n - done;
+        if (chunk > (size_t)available) {
+            chunk = available;
+        }
+        memcpy((unsigned char*)dst + done, reader->data + reader->next, chunk);
+        reader->next += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/* make at least n contiguous bytes available unless the file ends first,
+   n must fit in the buffer; returns the number available */
+ssize_t buf_ensure(BufReader* reader, size_t n) {
+    ssize_t bytesRead;
+    size_t left = reader->end - reader->next;
+    if (left >= n || reader->eof) {
+        return left;
+    }
+    if (reader->ring != NULL) {
+        return ring_ensure(reader, n);
+    }
+    /* slide unread bytes to the front and read behind them */
+    memmove(reader->data, reader->data + reader->next, left);
+    reader->offset += reader->next;
+    reader->next = 0;
+    reader->end = left;
+    while (reader->end < n) {
+        bytesRead = read_retry(reader->file, reader->data + reader->end, 
+                                reader->size - reader->end);
+        if (bytesRead == -1) {
+            return -1;
+        }
+        if (bytesRead == 0) {
+            reader->eof = 1;
+            break;
+        }
+        reader->end += bytesRead;
+    }
+    return reader->end;
+}
+
+/* drop the next n bytes, returns -1 if the file ends first */
+int buf_skip(BufReader* reader, uint64_t n) {
+    ssize_t available;
+    while (n > 0) {
+        available = buf_fill(reader);
+        if (available <= 0) {
+            return -1;
+        }
+        if ((uint64_t)available > n) {
+            available = n;
+        }
+        reader->next += available;
+        n -= available;
+    }
+    return 0;
+}
+
+/* go back to start of file, without a syscall if it is still buffered */
+int buf_rewind(BufReader* reader) {
+    if (reader->offset == 0) {
+        reader->next = 0;
+        return 0;
+    }
+    if (reader->ring != NULL) {
+        return ring_restart(reader, 0);
+    }
+    if (lseek(reader->file, 0, SEEK_SET) == -1) {
+        return -1;
+    }
+    reader->next = 0;
+    reader->end = 0;
+    reader->offset = 0;
+    reader->eof = 0;
+    return 0;
+}
+
+/* move to an absolute file offset, without a syscall if it is buffered */
+int buf_seek(BufReader* reader, off_t offset) {
+    if (offset >= reader->offset && 
+        offset <= reader->offset + (off_t)reader->end) {
+        reader->next = offset - reader->offset;
+        return 0;
+    }
+    if (reader->borrowed) {
+        return -1;
+    }
+    if (reader->ring != NULL) {
+        return ring_restart(reader, offset);
+    }
+    if (lseek(reader->file, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    reader->next = 0;
+    reader->end = 0;
+    reader->offset = offset;
+    reader->eof = 0;
+    return 0;
+}
+
+/* point view at up to n unread bytes and consume them without copying,
+   short only at end of file; returns -1 if the input is not all in
+   memory, in which case the caller copies with buf_read */
+ssize_t buf_view(BufReader* reader, const unsigned char** view, size_t n) {
+    if (!reader->borrowed) {
+        return -1;
+    }
+    if (n > reader->end - reader->next) {
+        n = reader->end - reader->next;
+    }
+    *view = reader->data + reader->next;
+    reader->next += n;
+    return n;
+}
+
+/* read ahead of the caller on a thread of its own through depth
+   buffers, so reads overlap the work done on what was read; called
+   before the first read, -1 with errno if the thread cannot be had */
+int buf_reader_async(BufReader* reader, int depth) {
+    IoRing *ring;
+    if (reader->borrowed || reader->ring != NULL) {
+        return 0;
+    }
+    ring = ring_new(reader->file, reader->size, depth);
+    if (ring == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (ring_start(ring, read_ahead) == -1) {
+        ring_free(ring);
+        return -1;
+    }
+    free(reader->data);
+    reader->data = ring->buffers[0];
+    reader->ring = ring;
+    return 0;
+}
+
+/* free reader, file descriptor is left open */
+void buf_reader_close(BufReader* reader) {
+    if (reader != NULL) {
+        if (reader->ring != NULL) {
+            ring_stop(reader->ring, 1);
+            ring_free(reader->ring);
+        } else if (reader->mapped) {
+            munmap(reader->data, reader->size);
+        } else if (!reader->borrowed) {
+            free(reader->data);
+        }
+        free(reader);
+    }
+}
+
+/* allocate writer that flushes every size bytes; with file -1 it only
+   collects bytes in memory and flushing it is an error */
+BufWriter* buf_writer_open(int file, size_t size) {
+    BufWriter* writer = malloc(sizeof(BufWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->data = malloc(size + IO_BUFFER_SLACK);
+    if (writer->data == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->file = file;
+    writer->size = size;
+    writer->count = 0;
+    writer->flushed = 0;
+    writer->discard = 0;
+    writer->borrowed = 0;
+    writer->full = 0;
+    writer->mapped = 0;
+    writer->checked = 0;
+    writer->ring = NULL;
+    return writer;
+}
+
+/* memory-only writer over size bytes of the caller's; there is no slack
+   past them, so a BitWriter may only use it if size leaves 
+   IO_BUFFER_SLACK bytes of data spare */
+BufWriter* buf_writer_wrap(unsigned char* data, size_t size) {
+    BufWriter* writer = malloc(sizeof(BufWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->data = data;
+    writer->file = -1;
+    writer->size = size;
+    writer->count = 0;
+    writer->flushed = 0;
+    writer->discard = 0;
+    writer->borrowed = 1;
+    writer->full = 0;
+    writer->mapped = 0;
+    writer->checked = 0;
+    writer->ring = NULL;
+    return writer;
+}
+
+/* number of leading bytes out of n to drop rather than write */
+static size_t take_discard(BufWriter* writer, size_t n) {
+    size_t skip = n;
+    if (writer->discard < skip) {
+        skip = writer->discard;
+    }
+    writer->discard -= skip;
+    return skip;
+}
+
+/* add the buffered bytes not yet in the checksum to it */
+static void update_checksum(BufWriter* writer) {
+    double clock = stats_clock();
+    writer->checksum = crc32c(writer->checksum, 
+                                writer->data + writer->checkedCount,
+                                writer->count - writer->checkedCount);
+    writer->checkedCount = writer->count;
+    stats_phase(STAT_CHECKSUM, clock);
+}
+
+/* append n bytes, large writes bypass the buffer unless a thread writes
+   them, which only takes whole buffers */
+int buf_write(BufWriter* writer, const void* src, size_t n) {
+    size_t skip;
+    double clock;
+    if (writer->count + n > writer->size) {
+        if (buf_flush(writer) == -1) {
+            return -1;
+        }
+        while (writer->ring != NULL && n > writer->size) {
+            memcpy(writer->data, src, writer->size);
+            writer->count = writer->size;
+            if (buf_flush(writer) == -1) {
+                return -1;
+            }
+            src = (const unsigned char*)src + writer->size;
+            n -= writer->size;
+        }
+        if (n >= writer->size && writer->ring == NULL) {
+            if (writer->checked) {
+                clock = stats_clock();
+                writer->checksum = crc32c(writer->checksum, src, n);
+                stats_phase(STAT_CHECKSUM, clock);
+            }
+            skip = take_discard(writer, n);
+            if ((writer->file == -1 || writer->mapped) && skip < n) {
+                writer->full = 1;
+                errno = ENOSPC;
+                return -1;
+            }
+            if (write_all(writer->file, (const unsigned char*)src + skip, 
+                            n - skip) == -1) {
+                return -1;
+            }
+            writer->flushed += n - skip;
+            return 0;
+        }
+    }
+    memcpy(writer->data + writer->count, src, n);
+    writer->count += n;
+    return 0;
+}
+
+/* write out everything buffered */
+int buf_flush(BufWriter* writer) {
+    size_t skip;
+    if (writer->checked) {
+        update_checksum(writer);
+        writer->checkedCount = 0;
+    }
+    skip = take_discard(writer, writer->count);
+    if ((writer->file == -1 || writer->mapped) && writer->count > skip) {
+        writer->full = 1;
+        errno = ENOSPC; /* memory-only writer ran out of room */
+        return -1;
+    }
+    if (writer->ring != NULL) {
+        return ring_flush(writer, skip);
+    }
+    if (write_all(writer->file, writer->data + skip, 
+                    writer->count - skip) == -1) {
+        return -1;
+    }
+    writer->flushed += writer->count - skip;
+    writer->count = 0;
+    return 0;
+}
+
+/* bytes written so far, buffered or not */
+uint64_t buf_position(const BufWriter* writer) {
+    return writer->flushed + writer->count;
+}
+
+/* start a checksum of the bytes written from here on, discarded ones
+   included */
+void buf_checksum_begin(BufWriter* writer) {
+    writer->checked = 1;
+    writer->checksum = 0;
+    writer->checkedCount = writer->count;
+}
+
+/* stop the checksum and return the CRC32C of the bytes written since
+   buf_checksum_begin */
+uint32_t buf_checksum_end(BufWriter* writer) {
+    update_checksum(writer);
+    writer->checked = 0;
+    return writer->checksum;
+}
+
+/* write behind the caller on a thread of its own through depth buffers,
+   so writes overlap the work that fills the next buffer; called before
+   the first write, -1 with errno if the thread cannot be had */
+int buf_writer_async(BufWriter* writer, int depth) {
+    IoRing *ring;
+    if (writer->file == -1 || writer->mapped || writer->ring != NULL) {
+        return 0;
+    }
+    ring = ring_new(writer->file, writer->size + IO_BUFFER_SLACK, depth);
+    if (ring == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (ring_start(ring, write_behind) == -1) {
+        ring_free(ring);
+        return -1;
+    }
+    free(writer->data);
+    writer->data = ring->buffers[0];
+    writer->ring = ring;
+    return 0;
+}
+
+/* write straight into a shared mapping of the first size bytes of the
+   file instead of through write(), when the output is known to take at
+   most size bytes; the file is cut back to what was written on close.
+   Only an unused writer over an empty regular file opened for reading
+   and writing can be mapped; -1 when this one cannot, and it is left
+   writing as before */
+int buf_writer_map(BufWriter* writer, uint64_t size) {
+    struct stat info;
+    void *data;
+    int mode;
+    if (writer->file == -1 || writer->borrowed || writer->mapped ||
+        writer->ring != NULL || buf_position(writer) > 0 || 
+        writer->discard > 0 || size == 0 || size > SIZE_MAX || 
+        (off_t)size < 0 ||
+        fstat(writer->file, &info) == -1 || !S_ISREG(info.st_mode) ||
+        info.st_size != 0 || lseek(writer->file, 0, SEEK_CUR) != 0) {
+        return -1;
+    }
+    mode = fcntl(writer->file, F_GETFL);
+    if (mode == -1 || (mode & O_ACCMODE) != O_RDWR || (mode & O_APPEND)) {
+        return -1;
+    }
+    /* reserve the blocks, so a full disk shows here rather than as a
+       SIGBUS on some later store into the mapping */
+    if (posix_fallocate(writer->file, 0, size) != 0) {
+        ftruncate(writer->file, 0);
+        return -1;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                writer->file, 0);
+    if (data == MAP_FAILED) {
+        ftruncate(writer->file, 0);
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    free(writer->data);
+    writer->data = data;
+    writer->size = size;
+    writer->mapped = 1;
+    return 0;
+}
+
+/* flush and free writer, file descriptor is left open; the bytes of a
+   wrapped writer stay in the caller's memory */
+int buf_writer_close(BufWriter* writer) {
+    int result;
+    if (writer == NULL) {
+        return 0;
+    }
+    if (writer->borrowed) {
+        free(writer);
+        return 0;
+    }
+    if (writer->mapped) {
+        /* the bytes are in the file already, only the spare room goes */
+        stats_bytes(0, writer->count);
+        munmap(writer->data, writer->size);
+        result = ftruncate(writer->file, writer->count);
+        free(writer);
+        return result;
+    }
+    result = buf_flush(writer);
+    if (writer->ring != NULL) {
+        /* the thread writes what it holds before leaving */
+        ring_stop(writer->ring, 0);
+        if (result == 0 && writer->ring->error != 0) {
+            errno = writer->ring->error;
+            result = -1;
+        }
+        ring_free(writer->ring);
+    } else {
+        free(writer->data);
+    }
+    free(writer);
+    return result;
+}
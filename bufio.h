@@ -0,0 +1,74 @@
+#ifndef BUFIO_H
+#define BUFIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DEFAULT_IO_BUFFER_SIZE (256 * 1024) /* default read/write buffer */
+#define MIN_IO_BUFFER_SIZE 16 /* smallest buffer accepted on command line */
+#define IO_BUFFER_SLACK 8 /* extra writer bytes for 8-byte bit stores */
+#define DEFAULT_IO_DEPTH 3 /* buffers per I/O thread: one with the
+                              thread, one with the coder, one spare */
+#define MAX_IO_DEPTH 64 /* most buffers an I/O thread cycles through */
+
+struct IoRing;
+
+/* buffered reader over a file descriptor */
+typedef struct BufReader {
+    int file;
+    unsigned char *data;
+    size_t size; /* capacity of data */
+    size_t next; /* first unread byte in data */
+    size_t end; /* one past last valid byte in data */
+    off_t offset; /* file offset of data[0] */
+    int eof; /* set once read returned 0 */
+    int borrowed; /* data holds the whole input, file is never read */
+    int mapped; /* data is a mapping of file, unmapped on close */
+    struct IoRing *ring; /* buffers a thread reads ahead into, NULL when
+                            reads are made as data is needed */
+} BufReader;
+
+/* buffered writer over a file descriptor */
+typedef struct BufWriter {
+    int file;
+    unsigned char *data; /* size + IO_BUFFER_SLACK bytes */
+    size_t size; /* bytes held before a flush is due */
+    size_t count; /* bytes waiting in data */
+    uint64_t flushed; /* bytes already handed to the file */
+    uint64_t discard; /* bytes still to drop instead of writing them */
+    int borrowed; /* data belongs to the caller and has no slack */
+    int full; /* set once a memory-only writer ran out of room */
+    int mapped; /* data is a shared mapping of the first size bytes of
+                   file, which is cut to count bytes on close */
+    int checked; /* keeping a checksum of what is written */
+    uint32_t checksum; /* CRC32C of the bytes before data + checkedCount */
+    size_t checkedCount; /* bytes of data already in checksum */
+    struct IoRing *ring; /* buffers a thread writes behind from, NULL when
+                            each flush writes before returning */
+} BufWriter;
+
+BufReader* buf_reader_open(int file, size_t size);
+BufReader* buf_reader_wrap(const unsigned char* data, size_t n);
+BufReader* buf_reader_map(int file, size_t minSize);
+ssize_t buf_fill(BufReader* reader);
+ssize_t buf_read(BufReader* reader, void* dst, size_t n);
+ssize_t buf_ensure(BufReader* reader, size_t n);
+int buf_skip(BufReader* reader, uint64_t n);
+int buf_rewind(BufReader* reader);
+int buf_seek(BufReader* reader, off_t offset);
+ssize_t buf_view(BufReader* reader, const unsigned char** view, size_t n);
+int buf_reader_async(BufReader* reader, int depth);
+void buf_reader_close(BufReader* reader);
+BufWriter* buf_writer_open(int file, size_t size);
+BufWriter* buf_writer_wrap(unsigned char* data, size_t size);
+int buf_write(BufWriter* writer, const void* src, size_t n);
+int buf_flush(BufWriter* writer);
+uint64_t buf_position(const BufWriter* writer);
+void buf_checksum_begin(BufWriter* writer);
+uint32_t buf_checksum_end(BufWriter* writer);
+int buf_writer_async(BufWriter* writer, int depth);
+int buf_writer_map(BufWriter* writer, uint64_t size);
+int buf_writer_close(BufWriter* writer);
+
+#endif
@@ -0,0 +1,198 @@
+#include <string.h>
+#include <pthread.h>
+#include "./checksum.h"
+
+#define CRC32C_POLY 0x82f63b78 /* Castagnoli polynomial, bit-reflected */
+#define CRC_LONG 8192 /* bytes per lane of the long interleaved loop */
+#define CRC_SHORT 256 /* bytes per lane of the short interleaved loop */
+
+/* where the x86 crc32 instruction can be asked for */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC_HARDWARE
+#endif
+
+/* slicing table k gives the crc of a byte followed by k zero bytes */
+static uint32_t slices[8][256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+static uint32_t (*kernel)(uint32_t crc, const unsigned char* data,
+                            size_t n);
+
+
+/* slicing-by-8: one table lookup per byte, eight bytes at a time */
+static uint32_t crc_software(uint32_t crc, const unsigned char* data,
+                                size_t n) {
+    uint32_t high;
+    while (n > 0 && ((size_t)data & 7) != 0) {
+        crc = (crc >> 8) ^ slices[0][(crc ^ *data++) & 0xff];
+        n--;
+    }
+    while (n >= 8) {
+        crc ^= (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+        high = (uint32_t)data[4] | ((uint32_t)data[5] << 8) |
+                ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+        crc = slices[7][crc & 0xff] ^ slices[6][(crc >> 8) & 0xff] ^
+                slices[5][(crc >> 16) & 0xff] ^ slices[4][crc >> 24] ^
+                slices[3][high & 0xff] ^ slices[2][(high >> 8) & 0xff] ^
+                slices[1][(high >> 16) & 0xff] ^ slices[0][high >> 24];
+        data += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        crc = (crc >> 8) ^ slices[0][(crc ^ *data++) & 0xff];
+        n--;
+    }
+    return crc;
+}
+
+#ifdef CRC_HARDWARE
+/* tables moving a crc past CRC_LONG or CRC_SHORT zero bytes, a byte of
+   the crc at a time */
+static uint32_t longZeros[4][256];
+static uint32_t shortZeros[4][256];
+
+/* GF(2) matrix of 32 columns times a vector */
+static uint32_t matrix_times(const uint32_t matrix[], uint32_t vector) {
+    uint32_t sum = 0;
+    while (vector != 0) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+static void matrix_square(uint32_t square[], const uint32_t matrix[]) {
+    int i;
+    for (i = 0; i < 32; i++) {
+        square[i] = matrix_times(matrix, matrix[i]);
+    }
+}
+
+/* tables moving a crc past n zero bytes, n a power of two */
+static void build_zeros(uint32_t zeros[][256], size_t n) {
+    uint32_t even[32], odd[32], row;
+    int i;
+    /* one zero bit, then two, then four */
+    odd[0] = CRC32C_POLY;
+    for (i = 1, row = 1; i < 32; i++, row <<= 1) {
+        odd[i] = row;
+    }
+    matrix_square(even, odd);
+    matrix_square(odd, even);
+    /* each square doubles the zeros, the first reaching one byte */
+    for (;;) {
+        matrix_square(even, odd);
+        if ((n >>= 1) == 0) {
+            break;
+        }
+        matrix_square(odd, even);
+        if ((n >>= 1) == 0) {
+            memcpy(even, odd, sizeof(even));
+            break;
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        zeros[0][i] = matrix_times(even, i);
+        zeros[1][i] = matrix_times(even, (uint32_t)i << 8);
+        zeros[2][i] = matrix_times(even, (uint32_t)i << 16);
+        zeros[3][i] = matrix_times(even, (uint32_t)i << 24);
+    }
+}
+
+static uint32_t shift_crc(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+            zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* crc32 instruction, 8 bytes a go; it takes 3 cycles but a new one can
+   start every cycle, so three lanes of the input are run side by side
+   and their crcs joined with the zeros tables */
+__attribute__((target("sse4.2")))
+static uint32_t crc_hardware(uint32_t crc, const unsigned char* data,
+                                size_t n) {
+    uint64_t crc0 = crc, crc1, crc2, word0, word1, word2;
+    const unsigned char *end;
+    while (n > 0 && ((size_t)data & 7) != 0) {
+        crc0 = __builtin_ia32_crc32qi(crc0, *data++);
+        n--;
+    }
+    while (n >= 3 * CRC_LONG) {
+        crc1 = 0;
+        crc2 = 0;
+        for (end = data + CRC_LONG; data < end; data += 8) {
+            memcpy(&word0, data, 8);
+            memcpy(&word1, data + CRC_LONG, 8);
+            memcpy(&word2, data + 2 * CRC_LONG, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, word0);
+            crc1 = __builtin_ia32_crc32di(crc1, word1);
+            crc2 = __builtin_ia32_crc32di(crc2, word2);
+        }
+        crc0 = shift_crc(longZeros, crc0) ^ crc1;
+        crc0 = shift_crc(longZeros, crc0) ^ crc2;
+        data += 2 * CRC_LONG;
+        n -= 3 * CRC_LONG;
+    }
+    while (n >= 3 * CRC_SHORT) {
+        crc1 = 0;
+        crc2 = 0;
+        for (end = data + CRC_SHORT; data < end; data += 8) {
+            memcpy(&word0, data, 8);
+            memcpy(&word1, data + CRC_SHORT, 8);
+            memcpy(&word2, data + 2 * CRC_SHORT, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, word0);
+            crc1 = __builtin_ia32_crc32di(crc1, word1);
+            crc2 = __builtin_ia32_crc32di(crc2, word2);
+        }
+        crc0 = shift_crc(shortZeros, crc0) ^ crc1;
+        crc0 = shift_crc(shortZeros, crc0) ^ crc2;
+        data += 2 * CRC_SHORT;
+        n -= 3 * CRC_SHORT;
+    }
+    for (; n >= 8; n -= 8, data += 8) {
+        memcpy(&word0, data, 8);
+        crc0 = __builtin_ia32_crc32di(crc0, word0);
+    }
+    while (n > 0) {
+        crc0 = __builtin_ia32_crc32qi(crc0, *data++);
+        n--;
+    }
+    return crc0;
+}
+#endif
+
+/* fill the tables and pick the kernel the processor can run */
+static void init_tables(void) {
+    uint32_t crc;
+    int i, k, bit;
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        slices[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            slices[k][i] = (slices[k - 1][i] >> 8) ^
+                            slices[0][slices[k - 1][i] & 0xff];
+        }
+    }
+    kernel = crc_software;
+#ifdef CRC_HARDWARE
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        build_zeros(longZeros, CRC_LONG);
+        build_zeros(shortZeros, CRC_SHORT);
+        kernel = crc_hardware;
+    }
+#endif
+}
+
+/* CRC32C of n bytes continuing crc, which is 0 for the first bytes */
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t n) {
+    pthread_once(&tablesOnce, init_tables);
+    return ~kernel(~crc, data, n);
+}
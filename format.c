@@ -0,0 +1,984 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "./format.h"
+#include "./ans.h"
+
+/* File layout (all integers big-endian):
+ *   magic    0xff 'H' 'U' 'F'
+ *   version  1 byte
+ *   flags    1 byte, any of FLAG_INDEX, FLAG_TABLE and FLAG_CHECKSUM
+ *   table id with FLAG_TABLE only: 4 bytes, code_table_id of the shared
+ *            table the BLOCK_SHARED blocks are coded with
+ *   blocks   until a BLOCK_END type byte; with FLAG_CHECKSUM each one
+ *            but the end block is followed by the CRC32C of its
+ *            characters, 4 bytes
+ *   index    with FLAG_INDEX only: for each block its coded offset,
+ *            decoded offset and body length in bits, 8 bytes each
+ *   trailer  with FLAG_INDEX only: index offset (8 bytes), block count
+ *            (4 bytes) and 'H' 'I' 'D' 'X', so it can be found from the end
+ *
+ * The lengths in block headers are varints since version 2: 7-bit
+ * groups, low group first, bit 7 set on all but the last, so blocks and
+ * whole files past 4 GiB fit. Version 1 wrote them in 4 bytes, as shared
+ * table files still do.
+ *
+ * A legacy file starts with its symbol count minus 1 and then 5-byte
+ * entries in ascending character order; 0xff claims all 256 characters,
+ * whose first entry has to be 0x00, so 0xff 'H' never starts one.
+ *
+ * BLOCK_HUFFMAN:
+ *   type       1 byte
+ *   charCount  length
+ *   bodyLength length
+ *   maxLength  1 byte, 0 for a one-character block
+ *   present    1 byte, number of characters with a code minus 1
+ *   symbols    the characters in ascending order when there are at most
+ *              LENGTH_BITMAP_BYTES of them, else a 32-byte bitmap with
+ *              bit 7 of byte 0 for character 0
+ *   lengths    code length of each present character in ascending order,
+ *              packed in as many bits as maxLength needs, 0-padded
+ *   body       bodyLength bytes
+ *
+ * BLOCK_STREAMS, for blocks with at least two characters:
+ *   as BLOCK_HUFFMAN up to the lengths, then
+ *   streams    1 byte, 2 to MAX_STREAMS
+ *   jump table byte length of every stream but the last, a length each
+ *   body       the streams one after the other, each 0-padded; stream k
+ *              codes the k-th run of charCount / streams characters,
+ *              rounded up, the last run taking what is left
+ *
+ * BLOCK_SHARED, in files with FLAG_TABLE:
+ *   type       1 byte
+ *   charCount  length
+ *   bodyLength length
+ *   body       bodyLength bytes, coded with the shared table
+ *
+ * BLOCK_STORED, for blocks that do not get smaller coded:
+ *   type       1 byte
+ *   charCount  length
+ *   body       the charCount characters
+ *
+ * BLOCK_RLE:
+ *   type       1 byte
+ *   charCount  length
+ *   bodyLength length
+ *   body       runs, each a character then its length minus 1 as a
+ *              varint
+ *
+ * BLOCK_ANS, for blocks with at least two characters:
+ *   type       1 byte
+ *   charCount  length
+ *   bodyLength length
+ *   tableLog   1 byte, ANS_MIN_TABLE_LOG to ANS_MAX_TABLE_LOG
+ *   present    1 byte, number of characters with a count minus 1
+ *   symbols    as in BLOCK_HUFFMAN
+ *   counts     states of each present character minus 1, in ascending
+ *              order, tableLog bits each, 0-padded; they add up to
+ *              1 << tableLog
+ *   body       0 bits up to a 1, the state decoding starts from in
+ *              tableLog bits, then the bits each decoding step takes
+ *
+ * BLOCK_PAIRS, for blocks with at least two symbols:
+ *   as BLOCK_HUFFMAN up to the lengths, then
+ *   codedCount length, symbols coded in the body
+ *   pairs      1 byte, number of symbols standing for two characters
+ *              minus 1
+ *   pair list  for each of them in ascending order the symbol, then its
+ *              first and second character, 3 bytes; the other symbols
+ *              stand for themselves
+ *   body       bodyLength bytes, the codedCount symbols
+ *
+ * An archive is 'H' 'A' 'R' 'C', then whole coded files one after the
+ * other, then its contents: for each file a 2-byte name length, the
+ * name, and the file's coded offset, coded length and decoded length,
+ * 8 bytes each; then a trailer of the contents offset (8 bytes), file
+ * count (4 bytes) and 'H' 'T' 'O' 'C'.
+ *
+ * A shared table file is 'H' 'T' 'B' 'L' then a version 1 BLOCK_HUFFMAN
+ * header of no characters and no body, giving every character a code. */
+
+static const unsigned char formatMagic[FORMAT_MAGIC_LENGTH] = 
+                                                    { 0xff, 'H', 'U', 'F' };
+static const unsigned char indexMagic[FORMAT_MAGIC_LENGTH] = 
+                                                    { 'H', 'I', 'D', 'X' };
+static const unsigned char tableMagic[FORMAT_MAGIC_LENGTH] = 
+                                                    { 'H', 'T', 'B', 'L' };
+static const unsigned char archiveMagic[FORMAT_MAGIC_LENGTH] = 
+                                                    { 'H', 'A', 'R', 'C' };
+static const unsigned char contentsMagic[FORMAT_MAGIC_LENGTH] = 
+                                                    { 'H', 'T', 'O', 'C' };
+
+/* number of bits needed to hold value */
+static int bits_for(int value) {
+    int bits = 0;
+    while ((1 << bits) <= value) {
+        bits++;
+    }
+    return bits;
+}
+
+static int write_u32(BufWriter* out, uint32_t value) {
+    unsigned char bytes[4];
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+    return buf_write(out, bytes, 4);
+}
+
+static int read_u32(BufReader* in, uint32_t* value) {
+    unsigned char bytes[4];
+    if (buf_read(in, bytes, 4) != 4) {
+        return -1;
+    }
+    *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | 
+             ((uint32_t)bytes[2] << 8) | bytes[3];
+    return 0;
+}
+
+static int write_u64(BufWriter* out, uint64_t value) {
+    if (write_u32(out, value >> 32) == -1) {
+        return -1;
+    }
+    return write_u32(out, value);
+}
+
+static int read_u64(BufReader* in, uint64_t* value) {
+    uint32_t high, low;
+    if (read_u32(in, &high) == -1 || read_u32(in, &low) == -1) {
+        return -1;
+    }
+    *value = ((uint64_t)high << 32) | low;
+    return 0;
+}
+
+/* bytes write_length takes for value in the current version */
+static size_t length_size(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) {
+        size++;
+    }
+    return size;
+}
+
+/* write a length of a block header, as a varint or, in version 1, in
+   4 bytes; -1 when it does not fit them */
+static int write_length(BufWriter* out, int version, uint64_t value) {
+    unsigned char groups[10];
+    int length = 0;
+    if (version == FORMAT_FIXED_LENGTHS) {
+        return value > UINT32_MAX ? -1 : write_u32(out, value);
+    }
+    for (; value >= 0x80; value >>= 7) {
+        groups[length++] = (value & 0x7f) | 0x80;
+    }
+    groups[length++] = value;
+    return buf_write(out, groups, length);
+}
+
+/* read a length written by write_length, -1 if truncated or past 64
+   bits */
+static int read_length(BufReader* in, int version, uint64_t* value) {
+    uint32_t fixed;
+    unsigned char group;
+    int shift = 0;
+    if (version == FORMAT_FIXED_LENGTHS) {
+        if (read_u32(in, &fixed) == -1) {
+            return -1;
+        }
+        *value = fixed;
+        return 0;
+    }
+    *value = 0;
+    do {
+        if (shift > 63 || buf_read(in, &group, 1) != 1 ||
+            (shift == 63 && group > 1)) {
+            return -1;
+        }
+        *value |= (uint64_t)(group & 0x7f) << shift;
+        shift += 7;
+    } while (group & 0x80);
+    return 0;
+}
+
+/* write magic, version and flags, and tableId with FLAG_TABLE */
+int write_file_header(BufWriter* out, int flags, uint32_t tableId) {
+    unsigned char versionFlags[2];
+    versionFlags[0] = FORMAT_VERSION;
+    versionFlags[1] = flags;
+    if (buf_write(out, formatMagic, FORMAT_MAGIC_LENGTH) == -1 ||
+        buf_write(out, versionFlags, 2) == -1) {
+        return -1;
+    }
+    return flags & FLAG_TABLE ? write_u32(out, tableId) : 0;
+}
+
+/* sniff file start; consumes the header and returns its version with its
+   flags and table id, or returns FORMAT_LEGACY consuming nothing, -1 on
+   error */
+int read_file_header(BufReader* in, int* flags, uint32_t* tableId) {
+    ssize_t available;
+    unsigned char versionFlags[2];
+    *flags = 0;
+    *tableId = 0;
+    available = buf_ensure(in, FORMAT_MAGIC_LENGTH);
+    if (available == -1) {
+        return -1;
+    }
+    if (available < FORMAT_MAGIC_LENGTH || memcmp(in->data + in->next,
+                            formatMagic, FORMAT_MAGIC_LENGTH) != 0) {
+        return FORMAT_LEGACY;
+    }
+    in->next += FORMAT_MAGIC_LENGTH;
+    if (buf_read(in, versionFlags, 2) != 2) {
+        fprintf(stderr, "truncated file header\n");
+        return -1;
+    }
+    if (versionFlags[0] == FORMAT_LEGACY || 
+        versionFlags[0] > FORMAT_VERSION) {
+        fprintf(stderr, "unsupported format version %d\n", versionFlags[0]);
+        return -1;
+    }
+    *flags = versionFlags[1];
+    if ((*flags & FLAG_TABLE) && read_u32(in, tableId) == -1) {
+        fprintf(stderr, "truncated file header\n");
+        return -1;
+    }
+    return versionFlags[0];
+}
+
+/* write the number of characters present, then the short list of them,
+   or the bitmap when that is smaller */
+static int write_present(BufWriter* out, const unsigned char bitmap[],
+                            const unsigned char symbols[], int present) {
+    unsigned char presentByte = present - 1;
+    if (buf_write(out, &presentByte, 1) == -1) {
+        return -1;
+    }
+    if (present <= LENGTH_BITMAP_BYTES) {
+        return buf_write(out, symbols, present);
+    }
+    return buf_write(out, bitmap, LENGTH_BITMAP_BYTES);
+}
+
+/* write header of a tANS block from its counts */
+static int write_ans_header(BufWriter* out, int version,
+                            const BlockHeader* header) {
+    unsigned char type = BLOCK_ANS, tableLog = header->tableLog;
+    unsigned char bitmap[LENGTH_BITMAP_BYTES];
+    unsigned char symbols[ASCII_TABLE_LENGTH];
+    int i, present = 0;
+    BitWriter counts;
+
+    memset(bitmap, 0, sizeof(bitmap));
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (header->counts[i] > 0) {
+            bitmap[i >> 3] |= 0x80 >> (i & 7);
+            symbols[present++] = i;
+        }
+    }
+    if (present == 0) {
+        return -1;
+    }
+    if (buf_write(out, &type, 1) == -1 || 
+        write_length(out, version, header->charCount) == -1 ||
+        write_length(out, version, header->bodyLength) == -1 ||
+        buf_write(out, &tableLog, 1) == -1 || 
+        write_present(out, bitmap, symbols, present) == -1) {
+        return -1;
+    }
+    bit_writer_init(&counts, out);
+    for (i = 0; i < present; i++) {
+        bit_write(&counts, header->counts[symbols[i]] - 1, tableLog);
+    }
+    return bit_writer_finish(&counts);
+}
+
+/* write the symbol count and pair list that end a pair block header */
+static int write_pair_list(BufWriter* out, int version,
+                            const BlockHeader* header) {
+    unsigned char pairByte = header->pairCount - 1;
+    if (header->pairCount < 1 || 
+        write_length(out, version, header->codedCount) == -1 ||
+        buf_write(out, &pairByte, 1) == -1) {
+        return -1;
+    }
+    return buf_write(out, header->pairs, 3 * header->pairCount);
+}
+
+/* write header of a huffman, streams or pair block from its canonical
+   codes, of a tANS block from its counts, or of a shared block, which
+   has none */
+int write_block_header(BufWriter* out, int version,
+                        const BlockHeader* header) {
+    int i, maxLength, lengthBits;
+    const HuffCode *codes = header->codes;
+    unsigned char type = header->type;
+    unsigned char bitmap[LENGTH_BITMAP_BYTES];
+    unsigned char symbols[ASCII_TABLE_LENGTH];
+    unsigned char maxByte, streams;
+    int present;
+    BitWriter lengths;
+
+    if (type == BLOCK_ANS) {
+        return write_ans_header(out, version, header);
+    }
+    if (type == BLOCK_SHARED || type == BLOCK_STORED || type == BLOCK_RLE) {
+        if (buf_write(out, &type, 1) == -1 || 
+            write_length(out, version, header->charCount) == -1) {
+            return -1;
+        }
+        return type == BLOCK_STORED ? 0 :
+                write_length(out, version, header->bodyLength);
+    }
+
+    maxLength = 0;
+    present = 0;
+    memset(bitmap, 0, sizeof(bitmap));
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (codes[i].length > maxLength) {
+            maxLength = codes[i].length;
+        }
+        if (codes[i].length > 0 || i == header->loneSymbol) {
+            bitmap[i >> 3] |= 0x80 >> (i & 7);
+            symbols[present++] = i;
+        }
+    }
+    if (present == 0) {
+        return -1;
+    }
+    maxByte = maxLength;
+    if (buf_write(out, &type, 1) == -1 || 
+        write_length(out, version, header->charCount) == -1 ||
+        write_length(out, version, header->bodyLength) == -1 ||
+        buf_write(out, &maxByte, 1) == -1 || 
+        write_present(out, bitmap, symbols, present) == -1) {
+        return -1;
+    }
+    lengthBits = bits_for(maxLength);
+    bit_writer_init(&lengths, out);
+    for (i = 0; i < ASCII_TABLE_LENGTH && maxLength > 0; i++) {
+        if (codes[i].length > 0) {
+            bit_write(&lengths, codes[i].length, lengthBits);
+        }
+    }
+    if (bit_writer_finish(&lengths) == -1) {
+        return -1;
+    }
+    if (type == BLOCK_PAIRS) {
+        return write_pair_list(out, version, header);
+    }
+    if (type != BLOCK_STREAMS) {
+        return 0;
+    }
+    streams = header->streamCount;
+    if (buf_write(out, &streams, 1) == -1) {
+        return -1;
+    }
+    for (i = 0; i < header->streamCount - 1; i++) {
+        if (write_length(out, version, header->streamLengths[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* bytes write_block_header writes for header in the current version */
+size_t block_header_size(const BlockHeader* header) {
+    int i, maxLength = 0, present = 0;
+    size_t size;
+    size = 1 + length_size(header->charCount);
+    switch (header->type) {
+        case BLOCK_STORED:
+            return size;
+        case BLOCK_SHARED:
+        case BLOCK_RLE:
+            return size + length_size(header->bodyLength);
+        case BLOCK_ANS:
+            for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+                present += header->counts[i] > 0;
+            }
+            return size + length_size(header->bodyLength) + 2 +
+                    (present <= LENGTH_BITMAP_BYTES ? present :
+                                                    LENGTH_BITMAP_BYTES) +
+                    (present * header->tableLog + 7) / 8;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (header->codes[i].length > maxLength) {
+            maxLength = header->codes[i].length;
+        }
+        if (header->codes[i].length > 0 || i == header->loneSymbol) {
+            present++;
+        }
+    }
+    size += length_size(header->bodyLength) + 2 +
+            (present <= LENGTH_BITMAP_BYTES ? present : LENGTH_BITMAP_BYTES);
+    size += (present * bits_for(maxLength) + 7) / 8;
+    if (header->type == BLOCK_STREAMS) {
+        size++;
+        for (i = 0; i < header->streamCount - 1; i++) {
+            size += length_size(header->streamLengths[i]);
+        }
+    } else if (header->type == BLOCK_PAIRS) {
+        size += length_size(header->codedCount) + 1 + 3 * header->pairCount;
+    }
+    return size;
+}
+
+/* write the block that closes the file */
+int write_end_block(BufWriter* out) {
+    unsigned char type = BLOCK_END;
+    return buf_write(out, &type, 1);
+}
+
+/* write the checksum that follows a block in files with FLAG_CHECKSUM */
+int write_block_checksum(BufWriter* out, uint32_t checksum) {
+    return write_u32(out, checksum);
+}
+
+int read_block_checksum(BufReader* in, uint32_t* checksum) {
+    return read_u32(in, checksum);
+}
+
+/* read the stream count and jump table of a streams block */
+static int read_stream_table(BufReader* in, int version,
+                                BlockHeader* header) {
+    int i;
+    unsigned char streams;
+    uint64_t left = header->bodyLength;
+    if (buf_read(in, &streams, 1) != 1) {
+        fprintf(stderr, "truncated block header\n");
+        return -1;
+    }
+    if (streams < 2 || streams > MAX_STREAMS) {
+        fprintf(stderr, "bad stream count %d\n", streams);
+        return -1;
+    }
+    header->streamCount = streams;
+    for (i = 0; i < streams - 1; i++) {
+        if (read_length(in, version, &header->streamLengths[i]) == -1) {
+            fprintf(stderr, "truncated block header\n");
+            return -1;
+        }
+        if (header->streamLengths[i] > left) {
+            fprintf(stderr, "corrupt stream jump table\n");
+            return -1;
+        }
+        left -= header->streamLengths[i];
+    }
+    header->streamLengths[i] = left;
+    return 0;
+}
+
+/* read the present count and the list or bitmap of characters written
+   by write_present into bitmap; returns the count, -1 if truncated */
+static int read_present(BufReader* in, unsigned char bitmap[]) {
+    unsigned char presentByte, symbols[LENGTH_BITMAP_BYTES];
+    int i, present;
+    if (buf_read(in, &presentByte, 1) != 1) {
+        return -1;
+    }
+    present = presentByte + 1;
+    if (present > LENGTH_BITMAP_BYTES) {
+        return buf_read(in, bitmap, LENGTH_BITMAP_BYTES) == 
+                LENGTH_BITMAP_BYTES ? present : -1;
+    }
+    /* turn symbol list into bitmap */
+    if (buf_read(in, symbols, present) != present) {
+        return -1;
+    }
+    memset(bitmap, 0, LENGTH_BITMAP_BYTES);
+    for (i = 0; i < present; i++) {
+        bitmap[symbols[i] >> 3] |= 0x80 >> (symbols[i] & 7);
+    }
+    return present;
+}
+
+/* read the counts of a tANS block after its table size and characters */
+static int read_ans_counts(BufReader* in, BlockHeader* header, 
+                            int tableLog, const unsigned char bitmap[],
+                            int present) {
+    unsigned char packed[(ASCII_TABLE_LENGTH * ANS_MAX_TABLE_LOG + 7) / 8];
+    int i, b, bitPos, packedBytes;
+    uint32_t count, sum = 0;
+
+    if (tableLog < ANS_MIN_TABLE_LOG || tableLog > ANS_MAX_TABLE_LOG) {
+        fprintf(stderr, "bad tANS table size %d\n", tableLog);
+        return -1;
+    }
+    header->tableLog = tableLog;
+    header->symbolCount = 0;
+    header->loneSymbol = -1;
+    header->maxLength = 0; /* no prefix codes */
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (bitmap[i >> 3] & (0x80 >> (i & 7))) {
+            header->symbolCount++;
+        }
+    }
+    if (header->symbolCount != present || present < 2) {
+        fprintf(stderr, "corrupt character list\n");
+        return -1;
+    }
+    packedBytes = (present * tableLog + 7) / 8;
+    if (buf_read(in, packed, packedBytes) != packedBytes) {
+        fprintf(stderr, "truncated tANS count table\n");
+        return -1;
+    }
+    bitPos = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        header->counts[i] = 0;
+        if ((bitmap[i >> 3] & (0x80 >> (i & 7))) == 0) {
+            continue;
+        }
+        count = 0;
+        for (b = 0; b < tableLog; b++, bitPos++) {
+            count = (count << 1) | 
+                        ((packed[bitPos >> 3] >> (7 - (bitPos & 7))) & 1);
+        }
+        header->counts[i] = count + 1;
+        sum += count + 1;
+    }
+    /* the counts share out every state */
+    if (sum != (uint32_t)1 << tableLog) {
+        fprintf(stderr, "corrupt tANS count table\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* read the symbol count and pair list of a pair block; every symbol
+   stands for one or two characters, which have to add up to charCount */
+static int read_pair_list(BufReader* in, int version,
+                            BlockHeader* header) {
+    unsigned char pairByte;
+    int i, size;
+    if (read_length(in, version, &header->codedCount) == -1 ||
+        buf_read(in, &pairByte, 1) != 1) {
+        fprintf(stderr, "truncated block header\n");
+        return -1;
+    }
+    header->pairCount = pairByte + 1;
+    size = 3 * header->pairCount;
+    if (buf_read(in, header->pairs, size) != size) {
+        fprintf(stderr, "truncated pair list\n");
+        return -1;
+    }
+    for (i = 1; i < header->pairCount; i++) {
+        if (header->pairs[i][0] <= header->pairs[i - 1][0]) {
+            fprintf(stderr, "corrupt pair list\n");
+            return -1;
+        }
+    }
+    if (header->codedCount > header->charCount ||
+        header->charCount - header->codedCount > header->codedCount) {
+        fprintf(stderr, "corrupt pair block\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* read block header and rebuild its canonical codes, -1 if malformed;
+   pair blocks add their pair list, tANS blocks give their counts
+   instead, and shared, stored and run blocks have no codes and
+   symbolCount 0 */
+int read_block_header(BufReader* in, int version, BlockHeader* header) {
+    int i, lengthBits, packedBytes, bitPos, length, b, present;
+    unsigned char type, maxByte;
+    unsigned char bitmap[LENGTH_BITMAP_BYTES];
+    unsigned char packed[ASCII_TABLE_LENGTH];
+    uint64_t kraft; /* sum of 2^(maxLength - length) */
+
+    if (buf_read(in, &type, 1) != 1) {
+        fprintf(stderr, "missing end of file block\n");
+        return -1;
+    }
+    header->type = type;
+    if (type == BLOCK_END) {
+        return 0;
+    }
+    if (type != BLOCK_HUFFMAN && type != BLOCK_STREAMS && 
+        type != BLOCK_SHARED && type != BLOCK_STORED && type != BLOCK_RLE &&
+        type != BLOCK_ANS && type != BLOCK_PAIRS) {
+        fprintf(stderr, "unknown block type %d\n", type);
+        return -1;
+    }
+    if (read_length(in, version, &header->charCount) == -1 ||
+        (type != BLOCK_STORED &&
+            read_length(in, version, &header->bodyLength) == -1)) {
+        fprintf(stderr, "truncated block header\n");
+        return -1;
+    }
+    if (type == BLOCK_STORED) {
+        header->bodyLength = header->charCount;
+    }
+    header->keepCount = header->charCount;
+    header->streamCount = 1;
+    header->streamLengths[0] = header->bodyLength;
+    if (type == BLOCK_SHARED || type == BLOCK_STORED || type == BLOCK_RLE) {
+        header->symbolCount = 0;
+        header->loneSymbol = -1;
+        header->maxLength = 0;
+        return 0;
+    }
+    if (buf_read(in, &maxByte, 1) != 1 ||
+        (present = read_present(in, bitmap)) == -1) {
+        fprintf(stderr, "truncated block header\n");
+        return -1;
+    }
+    if (type == BLOCK_ANS) {
+        return read_ans_counts(in, header, maxByte, bitmap, present);
+    }
+    header->maxLength = maxByte;
+    if (header->maxLength > MAX_PACKED_CODE_LENGTH) {
+        fprintf(stderr, "code length %d too long\n", header->maxLength);
+        return -1;
+    }
+
+    header->symbolCount = 0;
+    header->loneSymbol = -1;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        header->codes[i].bits = 0;
+        header->codes[i].length = 0;
+        if (bitmap[i >> 3] & (0x80 >> (i & 7))) {
+            header->codes[i].length = -1; /* present, length comes next */
+            header->loneSymbol = i;
+            header->symbolCount++;
+        }
+    }
+    if (header->symbolCount != present) {
+        fprintf(stderr, "corrupt character list\n");
+        return -1;
+    }
+    if (header->maxLength == 0) {
+        if (header->symbolCount != 1 || type != BLOCK_HUFFMAN) {
+            fprintf(stderr, "corrupt code length table\n");
+            return -1;
+        }
+        header->codes[header->loneSymbol].length = 0;
+        return 0;
+    }
+
+    /* unpack lengths of the present characters */
+    lengthBits = bits_for(header->maxLength);
+    packedBytes = (header->symbolCount * lengthBits + 7) / 8;
+    if (buf_read(in, packed, packedBytes) != packedBytes) {
+        fprintf(stderr, "truncated code length table\n");
+        return -1;
+    }
+    bitPos = 0;
+    kraft = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (header->codes[i].length == 0) {
+            continue;
+        }
+        length = 0;
+        for (b = 0; b < lengthBits; b++, bitPos++) {
+            length = (length << 1) | 
+                        ((packed[bitPos >> 3] >> (7 - (bitPos & 7))) & 1);
+        }
+        if (length == 0 || length > header->maxLength) {
+            fprintf(stderr, "corrupt code length table\n");
+            return -1;
+        }
+        header->codes[i].length = length;
+        kraft += (uint64_t)1 << (header->maxLength - length);
+    }
+    /* lengths of a full prefix code fill the code space exactly */
+    if (kraft != (uint64_t)1 << header->maxLength) {
+        fprintf(stderr, "corrupt code length table\n");
+        return -1;
+    }
+    assign_canonical_codes(header->codes);
+    if (type == BLOCK_STREAMS) {
+        return read_stream_table(in, version, header);
+    }
+    if (type == BLOCK_PAIRS) {
+        return read_pair_list(in, version, header);
+    }
+    return 0;
+}
+
+/* FNV-1a hash of the code lengths, naming a shared table in the files
+   coded with it */
+uint32_t code_table_id(const HuffCode codes[]) {
+    uint32_t hash = 2166136261U;
+    int i;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        hash = (hash ^ (uint32_t)codes[i].length) * 16777619U;
+    }
+    return hash;
+}
+
+/* write a shared table file for codes, which cover every character */
+int write_code_table(BufWriter* out, const HuffCode codes[]) {
+    BlockHeader header;
+    header.type = BLOCK_HUFFMAN;
+    header.charCount = 0;
+    header.bodyLength = 0;
+    header.loneSymbol = -1;
+    memcpy(header.codes, codes, sizeof(header.codes));
+    if (buf_write(out, tableMagic, FORMAT_MAGIC_LENGTH) == -1) {
+        return -1;
+    }
+    return write_block_header(out, FORMAT_FIXED_LENGTHS, &header);
+}
+
+/* read a shared table file into canonical codes, -1 if malformed or if
+   some character has no code */
+int read_code_table(BufReader* in, HuffCode codes[]) {
+    BlockHeader header;
+    unsigned char magic[FORMAT_MAGIC_LENGTH];
+    if (buf_read(in, magic, FORMAT_MAGIC_LENGTH) != FORMAT_MAGIC_LENGTH ||
+        memcmp(magic, tableMagic, FORMAT_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "not a code table file\n");
+        return -1;
+    }
+    if (read_block_header(in, FORMAT_FIXED_LENGTHS, &header) == -1) {
+        return -1;
+    }
+    if (header.type != BLOCK_HUFFMAN || 
+        header.symbolCount != ASCII_TABLE_LENGTH) {
+        fprintf(stderr, "code table does not cover every character\n");
+        return -1;
+    }
+    memcpy(codes, header.codes, sizeof(header.codes));
+    return 0;
+}
+
+void index_init(BlockIndex* index) {
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+}
+
+/* append a block, doubling the list when it is full */
+int index_add(BlockIndex* index, uint64_t codedOffset, 
+                uint64_t decodedOffset, uint64_t bodyBits) {
+    IndexEntry *entries;
+    size_t capacity;
+    if (index->count == index->capacity) {
+        capacity = index->capacity == 0 ? 64 : 2 * index->capacity;
+        entries = realloc(index->entries, capacity * sizeof(IndexEntry));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index->entries[index->count].codedOffset = codedOffset;
+    index->entries[index->count].decodedOffset = decodedOffset;
+    index->entries[index->count].bodyBits = bodyBits;
+    index->count++;
+    return 0;
+}
+
+/* write the index and its trailer, goes right after the end block */
+int write_index(BufWriter* out, const BlockIndex* index) {
+    size_t i;
+    uint64_t indexOffset = buf_position(out);
+    for (i = 0; i < index->count; i++) {
+        if (write_u64(out, index->entries[i].codedOffset) == -1 ||
+            write_u64(out, index->entries[i].decodedOffset) == -1 ||
+            write_u64(out, index->entries[i].bodyBits) == -1) {
+            return -1;
+        }
+    }
+    if (write_u64(out, indexOffset) == -1 || 
+        write_u32(out, index->count) == -1) {
+        return -1;
+    }
+    return buf_write(out, indexMagic, FORMAT_MAGIC_LENGTH);
+}
+
+/* load the index through its trailer at the end of a seekable file;
+   returns 0 when loaded, 1 when the file has none or cannot seek, and
+   -1 when it is malformed. The reader is left at an arbitrary offset */
+int read_index(BufReader* in, BlockIndex* index) {
+    off_t fileSize;
+    uint64_t indexOffset, entry[3];
+    uint32_t blockCount, i;
+    unsigned char magic[FORMAT_MAGIC_LENGTH];
+
+    index_init(index);
+    if (in->borrowed) {
+        fileSize = in->end;
+    } else if ((fileSize = lseek(in->file, 0, SEEK_END)) == -1) {
+        return 1;
+    }
+    if (fileSize < INDEX_TRAILER_SIZE || 
+        buf_seek(in, fileSize - INDEX_TRAILER_SIZE) == -1) {
+        return 1;
+    }
+    if (read_u64(in, &indexOffset) == -1 || read_u32(in, &blockCount) == -1 ||
+        buf_read(in, magic, FORMAT_MAGIC_LENGTH) != FORMAT_MAGIC_LENGTH ||
+        memcmp(magic, indexMagic, FORMAT_MAGIC_LENGTH) != 0) {
+        return 1;
+    }
+    if (indexOffset + (uint64_t)blockCount * INDEX_ENTRY_SIZE + 
+        INDEX_TRAILER_SIZE != (uint64_t)fileSize || 
+        buf_seek(in, indexOffset) == -1) {
+        fprintf(stderr, "corrupt block index\n");
+        return -1;
+    }
+    for (i = 0; i < blockCount; i++) {
+        if (read_u64(in, &entry[0]) == -1 || read_u64(in, &entry[1]) == -1 ||
+            read_u64(in, &entry[2]) == -1) {
+            fprintf(stderr, "truncated block index\n");
+            free_index(index);
+            return -1;
+        }
+        /* blocks must appear in file order */
+        if ((i > 0 && (entry[0] <= index->entries[i - 1].codedOffset ||
+                        entry[1] < index->entries[i - 1].decodedOffset)) ||
+            entry[0] >= indexOffset) {
+            fprintf(stderr, "corrupt block index\n");
+            free_index(index);
+            return -1;
+        }
+        if (index_add(index, entry[0], entry[1], entry[2]) == -1) {
+            perror("malloc");
+            free_index(index);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* number of the last block starting at or before decodedOffset */
+size_t index_find(const BlockIndex* index, uint64_t decodedOffset) {
+    size_t low = 0, high = index->count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (index->entries[middle].decodedOffset <= decodedOffset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void free_index(BlockIndex* index) {
+    free(index->entries);
+    index_init(index);
+}
+
+/* write the magic an archive starts with */
+int write_archive_header(BufWriter* out) {
+    return buf_write(out, archiveMagic, FORMAT_MAGIC_LENGTH);
+}
+
+/* write the contents and trailer, after the last member */
+int write_archive_contents(BufWriter* out, const ArchiveMember members[],
+                            size_t count) {
+    uint64_t contentsOffset = buf_position(out);
+    unsigned char nameLength[2];
+    size_t i, length;
+    for (i = 0; i < count; i++) {
+        length = strlen(members[i].name);
+        nameLength[0] = length >> 8;
+        nameLength[1] = length;
+        if (buf_write(out, nameLength, 2) == -1 ||
+            buf_write(out, members[i].name, length) == -1 ||
+            write_u64(out, members[i].codedOffset) == -1 ||
+            write_u64(out, members[i].codedLength) == -1 ||
+            write_u64(out, members[i].decodedLength) == -1) {
+            return -1;
+        }
+    }
+    if (write_u64(out, contentsOffset) == -1 || 
+        write_u32(out, count) == -1) {
+        return -1;
+    }
+    return buf_write(out, contentsMagic, FORMAT_MAGIC_LENGTH);
+}
+
+/* load the contents of a seekable archive through its trailer; -1 with
+   a message when it is not an archive or is malformed. The reader is
+   left at an arbitrary offset */
+int read_archive_contents(BufReader* in, ArchiveMember** members, 
+                            size_t* count) {
+    off_t fileSize;
+    uint64_t contentsOffset;
+    uint32_t memberCount, i;
+    unsigned char magic[FORMAT_MAGIC_LENGTH], nameLength[2];
+    ArchiveMember *member;
+    size_t length;
+
+    *members = NULL;
+    *count = 0;
+    if (in->borrowed) {
+        fileSize = in->end;
+    } else if ((fileSize = lseek(in->file, 0, SEEK_END)) == -1) {
+        perror("lseek");
+        return -1;
+    }
+    if (fileSize < FORMAT_MAGIC_LENGTH + ARCHIVE_TRAILER_SIZE ||
+        buf_seek(in, 0) == -1 ||
+        buf_read(in, magic, FORMAT_MAGIC_LENGTH) != FORMAT_MAGIC_LENGTH ||
+        memcmp(magic, archiveMagic, FORMAT_MAGIC_LENGTH) != 0 ||
+        buf_seek(in, fileSize - ARCHIVE_TRAILER_SIZE) == -1 ||
+        read_u64(in, &contentsOffset) == -1 || 
+        read_u32(in, &memberCount) == -1 ||
+        buf_read(in, magic, FORMAT_MAGIC_LENGTH) != FORMAT_MAGIC_LENGTH ||
+        memcmp(magic, contentsMagic, FORMAT_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "not an archive\n");
+        return -1;
+    }
+    if (contentsOffset > (uint64_t)fileSize - ARCHIVE_TRAILER_SIZE ||
+        buf_seek(in, contentsOffset) == -1) {
+        fprintf(stderr, "corrupt archive contents\n");
+        return -1;
+    }
+    *members = calloc(memberCount > 0 ? memberCount : 1, 
+                        sizeof(ArchiveMember));
+    if (*members == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < memberCount; i++) {
+        member = &(*members)[i];
+        if (buf_read(in, nameLength, 2) != 2) {
+            fprintf(stderr, "truncated archive contents\n");
+            free_archive_contents(*members, i);
+            return -1;
+        }
+        length = (nameLength[0] << 8) | nameLength[1];
+        member->name = malloc(length + 1);
+        if (member->name == NULL) {
+            perror("malloc");
+            free_archive_contents(*members, i);
+            return -1;
+        }
+        if (buf_read(in, member->name, length) != (ssize_t)length ||
+            read_u64(in, &member->codedOffset) == -1 ||
+            read_u64(in, &member->codedLength) == -1 ||
+            read_u64(in, &member->decodedLength) == -1) {
+            fprintf(stderr, "truncated archive contents\n");
+            free_archive_contents(*members, i + 1);
+            return -1;
+        }
+        member->name[length] = '\0';
+        /* members lie between the archive magic and the contents */
+        if (length == 0 || strlen(member->name) != length ||
+            member->codedOffset < FORMAT_MAGIC_LENGTH ||
+            member->codedOffset > contentsOffset ||
+            member->codedLength > contentsOffset - member->codedOffset) {
+            fprintf(stderr, "corrupt archive contents\n");
+            free_archive_contents(*members, i + 1);
+            return -1;
+        }
+    }
+    *count = memberCount;
+    return 0;
+}
+
+void free_archive_contents(ArchiveMember members[], size_t count) {
+    size_t i;
+    for (i = 0; members != NULL && i < count; i++) {
+        free(members[i].name);
+    }
+    free(members);
+}
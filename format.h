@@ -0,0 +1,111 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include "./huffman.h"
+
+#define FORMAT_MAGIC_LENGTH 4 /* bytes of magic at start of file */
+#define FORMAT_VERSION 2 /* version written by hencode */
+#define FORMAT_FIXED_LENGTHS 1 /* version with 4-byte block lengths, which
+                                  later versions write as varints */
+#define FORMAT_LEGACY 0 /* version reported for files without magic */
+#define LENGTH_BITMAP_BYTES (ASCII_TABLE_LENGTH / 8) /* characters present */
+
+/* file header flags */
+#define FLAG_INDEX 0x01 /* a block index follows the end block */
+#define FLAG_TABLE 0x02 /* blocks may use the shared table the header names */
+#define FLAG_CHECKSUM 0x04 /* each block ends in a checksum of its characters */
+
+#define TABLE_ID_SIZE 4 /* bytes of shared table id in the file header */
+#define BLOCK_CHECKSUM_SIZE 4 /* bytes of checksum after a block's body */
+#define INDEX_ENTRY_SIZE 24 /* bytes per block in the index */
+#define INDEX_TRAILER_SIZE 16 /* index offset, block count and magic */
+#define ARCHIVE_TRAILER_SIZE 16 /* contents offset, member count, magic */
+#define MAX_MEMBER_NAME 4096 /* longest member name in an archive */
+
+/* block types */
+#define BLOCK_END 0 /* no more blocks */
+#define BLOCK_HUFFMAN 1 /* canonical code lengths then coded body */
+#define BLOCK_STREAMS 2 /* as BLOCK_HUFFMAN, body split into streams */
+#define BLOCK_SHARED 3 /* body coded with the file's shared table */
+#define BLOCK_STORED 4 /* characters as they are */
+#define BLOCK_RLE 5 /* runs of one character */
+#define BLOCK_ANS 6 /* normalized counts then tANS coded body */
+#define BLOCK_PAIRS 7 /* as BLOCK_HUFFMAN, some symbols coding two
+                         characters */
+
+/* parsed block header */
+typedef struct BlockHeader {
+    int type;
+    uint64_t charCount; /* characters coded in the block */
+    uint64_t bodyLength; /* bytes of body following the header */
+    int symbolCount; /* characters with a code, filled in on read */
+    int loneSymbol; /* the character of a one-character block, else -1 */
+    int maxLength; /* longest code length, filled in on read */
+    uint64_t bodyBits; /* body length before padding, not stored */
+    uint64_t keepCount; /* characters to write out, charCount on read */
+    int streamCount; /* 1, or the streams of a BLOCK_STREAMS body */
+    uint64_t streamLengths[MAX_STREAMS]; /* bytes of each stream, the
+                                            whole body for one stream */
+    HuffCode codes[ASCII_TABLE_LENGTH]; /* canonical codes */
+    int tableLog; /* BLOCK_ANS: log2 of the number of coder states */
+    uint16_t counts[ASCII_TABLE_LENGTH]; /* BLOCK_ANS: states of each
+                                            character, 1 << tableLog in
+                                            all */
+    uint64_t codedCount; /* BLOCK_PAIRS: symbols in the body, charCount
+                            less one for each pair coded */
+    int pairCount; /* BLOCK_PAIRS: symbols standing for two characters */
+    unsigned char pairs[ASCII_TABLE_LENGTH][3]; /* BLOCK_PAIRS: each such
+                                                   symbol then its two
+                                                   characters, in
+                                                   ascending order */
+} BlockHeader;
+
+/* where a block starts in the coded and in the decoded file */
+typedef struct IndexEntry {
+    uint64_t codedOffset; /* file offset of the block type byte */
+    uint64_t decodedOffset; /* characters in all earlier blocks */
+    uint64_t bodyBits; /* body length before padding */
+} IndexEntry;
+
+/* growable list of blocks, in file order */
+typedef struct BlockIndex {
+    IndexEntry *entries;
+    size_t count;
+    size_t capacity;
+} BlockIndex;
+
+/* one coded file in an archive */
+typedef struct ArchiveMember {
+    char *name; /* path it was coded from, and is decoded to */
+    uint64_t codedOffset; /* archive offset of the coded file */
+    uint64_t codedLength;
+    uint64_t decodedLength;
+} ArchiveMember;
+
+int write_file_header(BufWriter* out, int flags, uint32_t tableId);
+int read_file_header(BufReader* in, int* flags, uint32_t* tableId);
+int write_block_header(BufWriter* out, int version,
+                        const BlockHeader* header);
+size_t block_header_size(const BlockHeader* header);
+int write_end_block(BufWriter* out);
+int write_block_checksum(BufWriter* out, uint32_t checksum);
+int read_block_checksum(BufReader* in, uint32_t* checksum);
+int read_block_header(BufReader* in, int version, BlockHeader* header);
+uint32_t code_table_id(const HuffCode codes[]);
+int write_code_table(BufWriter* out, const HuffCode codes[]);
+int read_code_table(BufReader* in, HuffCode codes[]);
+void index_init(BlockIndex* index);
+int index_add(BlockIndex* index, uint64_t codedOffset, 
+                uint64_t decodedOffset, uint64_t bodyBits);
+int write_index(BufWriter* out, const BlockIndex* index);
+int read_index(BufReader* in, BlockIndex* index);
+size_t index_find(const BlockIndex* index, uint64_t decodedOffset);
+void free_index(BlockIndex* index);
+int write_archive_header(BufWriter* out);
+int write_archive_contents(BufWriter* out, const ArchiveMember members[],
+                            size_t count);
+int read_archive_contents(BufReader* in, ArchiveMember** members, 
+                            size_t* count);
+void free_archive_contents(ArchiveMember members[], size_t count);
+
+#endif
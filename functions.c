@@ -1,22 +1,21 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "./functions.h"
 
-/* utility function to test for empty file */
-int file_is_empty(int file){
-  int result;
-  unsigned char buffer[1];
-  off_t offset;
-  result = read(file, &buffer, 1);
-  if (result > 0) {
-    offset = lseek(file, 0, SEEK_SET); /* go back to beginning of file */
-    if (offset == -1) {
-        perror("lseek");
-        return -1;
-    }
+/* utility function to test for empty file, returns 0 when empty */
+int file_is_empty(BufReader* in){
+  ssize_t result;
+  result = buf_fill(in); /* peeks, nothing is consumed */
+  if (result == -1) {
+    perror("read");
+    return -1;
   }
-  return result;
+  return result > 0;
 }
 /* utility function to convert unisgned char to strings of 0s and 1s */
 int char_to_8_bit_string(unsigned char buf, char* eight_bits) {
@@ -29,4 +28,85 @@ int char_to_8_bit_string(unsigned char buf, char* eight_bits) {
         bitmask = bitmask >> 1; /* move mask to next bit*/
         }
     return 0;
-}
\ No newline at end of file
+}
+
+/* utility function to parse sizes like 4096, 256K or 1M */
+int parse_size(const char* text, size_t* size) {
+    char *end;
+    unsigned long value;
+    value = strtoul(text, &end, 10);
+    if (end == text) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K':
+            value <<= 10;
+            end++;
+            break;
+        case 'm': case 'M':
+            value <<= 20;
+            end++;
+            break;
+        case 'g': case 'G':
+            value <<= 30;
+            end++;
+            break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+/* utility function to read a list of paths, each ended by separator or
+   by the end of file, skipping empty ones; the list and its strings are
+   one allocation, freed with free */
+char** read_path_list(int file, char separator, size_t* count) {
+    char *text = NULL, *grown, **list;
+    size_t length = 0, capacity = 0, i, n, end;
+    ssize_t bytesRead;
+    do {
+        if (length == capacity) {
+            capacity = capacity == 0 ? 4096 : 2 * capacity;
+            grown = realloc(text, capacity + 1);
+            if (grown == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = grown;
+        }
+        bytesRead = read(file, text + length, capacity - length);
+        if (bytesRead > 0) {
+            length += bytesRead;
+        }
+    } while (bytesRead > 0 || (bytesRead == -1 && errno == EINTR));
+    if (bytesRead == -1) {
+        free(text);
+        return NULL;
+    }
+    text[length++] = separator;
+    n = 0;
+    for (i = 0; i < length; i++) {
+        n += text[i] == separator;
+    }
+    /* pointers first, then the text they point into */
+    list = malloc(n * sizeof(char*) + length);
+    if (list == NULL) {
+        free(text);
+        return NULL;
+    }
+    memcpy(list + n, text, length);
+    free(text);
+    text = (char*)(list + n);
+    *count = 0;
+    for (i = 0; i < length; i = end + 1) {
+        for (end = i; text[end] != separator; end++) {
+        }
+        text[end] = '\0';
+        if (end > i) {
+            list[(*count)++] = text + i;
+        }
+    }
+    return list;
+}
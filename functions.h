@@ -1,3 +1,11 @@
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
 
-int file_is_empty(int file);
+#include "./bufio.h"
+
+int file_is_empty(BufReader* in);
 int char_to_8_bit_string(unsigned char buff, char *eightBits);
+int parse_size(const char* text, size_t* size);
+char** read_path_list(int file, char separator, size_t* count);
+
+#endif
@@ -0,0 +1,438 @@
+#define _DEFAULT_SOURCE /* clock_gettime */
+#include "./libhuffman.h"
+#include "./huffman.h"
+#include "./block.h"
+#include "./functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SIZES "1K,64K,1M,16M" /* corpus sizes when -n is not given */
+#define DEFAULT_RUNS 5 /* timed runs per phase */
+#define MAX_SIZES 16
+#define MAX_RUNS 1000
+#define PHASE_COUNT 5
+#define CORPUS_COUNT 5
+
+/* the phases timed separately, histogram to decode */
+enum { PHASE_HISTOGRAM, PHASE_TREE, PHASE_TABLE, PHASE_ENCODE, PHASE_DECODE };
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "histogram", "tree", "table", "encode", "decode"
+};
+
+static const char *corpusNames[CORPUS_COUNT] = {
+    "uniform", "zipf", "single", "text", "runs"
+};
+
+/* words an English-like corpus is drawn from, most frequent first */
+static const char *words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "that", "for", "it", "as",
+    "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+    "his", "from", "at", "which", "but", "have", "an", "had", "they", "you",
+    "were", "their", "one", "all", "we", "can", "her", "has", "there",
+    "been", "if", "more", "when", "will", "would", "who", "so", "no",
+    "time", "people", "number", "water", "between", "government", "world",
+    "through", "another", "however", "information", "development"
+};
+
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+/* timings of one phase over every run, seconds */
+typedef struct PhaseTimes {
+    double seconds[MAX_RUNS];
+    int runs;
+} PhaseTimes;
+
+/* deterministic xorshift generator so runs compare across machines */
+static uint32_t next_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* index drawn from a Zipf distribution given its cumulative weights */
+static int next_zipf(uint32_t* state, const double cdf[], int count) {
+    double u = next_random(state) / 4294967296.0;
+    int low = 0, high = count - 1, middle;
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (cdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* cumulative weights of 1/rank over count ranks */
+static void zipf_table(double cdf[], int count) {
+    double sum = 0, total = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        total += 1.0 / (i + 1);
+    }
+    for (i = 0; i < count; i++) {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum / total;
+    }
+}
+
+/* fill data with n bytes of the named corpus, the same bytes every run */
+static void fill_corpus(unsigned char* data, size_t n, const char* kind) {
+    double cdf[ASCII_TABLE_LENGTH];
+    uint32_t state = 2463534242U, r;
+    size_t i = 0, length;
+    const char *word;
+    unsigned char value;
+
+    if (strcmp(kind, "uniform") == 0) {
+        for (i = 0; i < n; i++) {
+            data[i] = next_random(&state);
+        }
+    } else if (strcmp(kind, "zipf") == 0) {
+        /* byte ranks shuffled by a multiplier so low values are not favored */
+        zipf_table(cdf, ASCII_TABLE_LENGTH);
+        for (i = 0; i < n; i++) {
+            data[i] = next_zipf(&state, cdf, ASCII_TABLE_LENGTH) * 167 + 13;
+        }
+    } else if (strcmp(kind, "single") == 0) {
+        memset(data, 'x', n);
+    } else if (strcmp(kind, "text") == 0) {
+        zipf_table(cdf, WORD_COUNT);
+        while (i < n) {
+            word = words[next_zipf(&state, cdf, WORD_COUNT)];
+            for (length = 0; word[length] != '\0' && i < n; length++) {
+                data[i++] = word[length];
+            }
+            r = next_random(&state);
+            if (i < n) {
+                data[i++] = r % 71 == 0 ? '\n' : r % 13 == 0 ? ',' :
+                            r % 17 == 0 ? '.' : ' ';
+            }
+        }
+    } else {
+        /* runs of 1 to 4096 bytes, half of them zero */
+        while (i < n) {
+            r = next_random(&state);
+            value = r & 1 ? 0 : r >> 24;
+            length = (r >> 1) % 4096 + 1;
+            for (; length > 0 && i < n; length--) {
+                data[i++] = value;
+            }
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* the q quantile of sorted seconds, nearest rank */
+static double percentile(const double sorted[], int runs, double q) {
+    return sorted[(int)(q * (runs - 1) + 0.5)];
+}
+
+/* decode the coded bytes through temporary files, for the legacy format,
+   which cannot be decoded from memory */
+static int decompress_through_files(HuffContext* context,
+                                    const unsigned char* encoded,
+                                    size_t compressed, unsigned char* decoded,
+                                    size_t capacity, size_t* written) {
+    FILE *in = tmpfile(), *out = tmpfile();
+    int result = -1;
+    *written = 0;
+    if (in == NULL || out == NULL) {
+        perror("tmpfile");
+        goto done;
+    }
+    if (fwrite(encoded, 1, compressed, in) != compressed || fflush(in) != 0) {
+        perror("fwrite");
+        goto done;
+    }
+    rewind(in);
+    if (huff_decode_file(context, fileno(in), fileno(out)) != 0) {
+        goto done;
+    }
+    rewind(out);
+    *written = fread(decoded, 1, capacity, out);
+    if (fgetc(out) != EOF) { /* more than fits, so no match */
+        (*written)++;
+    }
+    result = 0;
+done:
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return result;
+}
+
+/* time every phase over runs passes of one corpus; returns -1 if a pass
+   fails or the round trip does not match */
+static int run_corpus(const unsigned char* data, size_t n,
+                        const HuffOptions* options, int runs,
+                        PhaseTimes times[], size_t* compressed) {
+    uint64_t histogram[ASCII_TABLE_LENGTH];
+    BlockHeader block;
+    DecodeTable table;
+    HuffContext *context;
+    unsigned char *encoded, *decoded;
+    size_t bound, written;
+    double start;
+    int run, result = -1;
+
+    context = huff_context_new(options);
+    if (context == NULL) {
+        return -1;
+    }
+    bound = huff_compress_bound(context, n);
+    encoded = malloc(bound);
+    decoded = malloc(n);
+    if (encoded == NULL || decoded == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    for (run = 0; run < runs; run++) {
+        start = now();
+        memset(histogram, 0, sizeof(histogram));
+        count_bytes(histogram, data, n);
+        times[PHASE_HISTOGRAM].seconds[run] = now() - start;
+
+        start = now();
+        if (plan_block(histogram, options->maxLength, &block) != 0) {
+            goto done;
+        }
+        times[PHASE_TREE].seconds[run] = now() - start;
+
+        start = now();
+        if (build_decode_table(block.codes, &table) != 0) {
+            fprintf(stderr, "decode table failed\n");
+            goto done;
+        }
+        times[PHASE_TABLE].seconds[run] = now() - start;
+
+        start = now();
+        if (huff_compress(context, data, n, encoded, bound, compressed) != 0) {
+            perror("huff_compress");
+            goto done;
+        }
+        times[PHASE_ENCODE].seconds[run] = now() - start;
+
+        start = now();
+        if ((options->legacy ?
+            decompress_through_files(context, encoded, *compressed,
+                                        decoded, n, &written) :
+            huff_decompress(context, encoded, *compressed, decoded, n,
+                            &written)) != 0) {
+            perror("huff_decompress");
+            goto done;
+        }
+        times[PHASE_DECODE].seconds[run] = now() - start;
+        if (written != n || memcmp(decoded, data, n) != 0) {
+            fprintf(stderr, "round trip does not match\n");
+            goto done;
+        }
+    }
+    for (run = 0; run < PHASE_COUNT; run++) {
+        times[run].runs = runs;
+        qsort(times[run].seconds, runs, sizeof(double), compare_doubles);
+    }
+    result = 0;
+done:
+    free(encoded);
+    free(decoded);
+    huff_context_free(context);
+    return result;
+}
+
+/* one line per phase: percentiles of time, and of MB/s for the phases that
+   touch every byte */
+static void report_text(const char* corpus, size_t n, size_t compressed,
+                        const PhaseTimes times[]) {
+    const double *s;
+    int phase, runs;
+    printf("%s %lu bytes, ratio %.4f\n", corpus, (unsigned long)n,
+            n > 0 ? (double)compressed / n : 0);
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        s = times[phase].seconds;
+        runs = times[phase].runs;
+        printf("  %-10s p50 %10.1f us  p90 %10.1f us  p99 %10.1f us",
+                phaseNames[phase], percentile(s, runs, 0.5) * 1e6,
+                percentile(s, runs, 0.9) * 1e6,
+                percentile(s, runs, 0.99) * 1e6);
+        if (phase == PHASE_HISTOGRAM || phase >= PHASE_ENCODE) {
+            /* the slowest run gives the lowest rate, so p90 rate uses the
+               p10 time */
+            printf("  %9.1f MB/s p50 %9.1f MB/s p90",
+                    n / percentile(s, runs, 0.5) / 1e6,
+                    n / percentile(s, runs, 0.1) / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+static void report_json(FILE* json, const char* corpus, size_t n,
+                        size_t compressed, const PhaseTimes times[],
+                        bool first) {
+    const double *s;
+    int phase, runs;
+    fprintf(json, "%s\n  {\"corpus\": \"%s\", \"bytes\": %lu, "
+            "\"compressed\": %lu, \"ratio\": %.6f, \"phases\": {",
+            first ? "" : ",", corpus, (unsigned long)n,
+            (unsigned long)compressed, n > 0 ? (double)compressed / n : 0);
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        s = times[phase].seconds;
+        runs = times[phase].runs;
+        fprintf(json, "%s\n    \"%s\": {\"runs\": %d, \"min\": %.9f, "
+                "\"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, "
+                "\"max\": %.9f, \"mbps_p50\": %.3f}",
+                phase == 0 ? "" : ",", phaseNames[phase], runs, s[0],
+                percentile(s, runs, 0.5), percentile(s, runs, 0.9),
+                percentile(s, runs, 0.99), s[runs - 1],
+                n / percentile(s, runs, 0.5) / 1e6);
+    }
+    fprintf(json, "\n  }}");
+}
+
+/* split a comma separated list of sizes */
+static int parse_sizes(char* list, size_t sizes[]) {
+    char *item;
+    int count = 0;
+    for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == MAX_SIZES || parse_size(item, &sizes[count]) != 0 ||
+            sizes[count] == 0) {
+            fprintf(stderr, "bad size list\n");
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: hbench [-n sizes] [-c corpus] [-r runs] "
+            "[-B blockSize] [-s streams] [-j threads] [-l maxLength] "
+            "[-L] [-o json]\n"
+            "  sizes are comma separated, e.g. 1K,1M,4G; corpora are "
+            "uniform, zipf,\n  single, text and runs; -L codes whole "
+            "corpora in the legacy format\n");
+}
+
+int main(int argc, char** argv) {
+    static PhaseTimes times[PHASE_COUNT];
+    char defaultSizes[] = DEFAULT_SIZES;
+    char *sizeList = defaultSizes, *only = NULL, *jsonPath = NULL;
+    size_t sizes[MAX_SIZES], value, compressed;
+    HuffOptions options;
+    unsigned char *data;
+    FILE *json = NULL;
+    int i, j, sizeCount, runs = DEFAULT_RUNS, result = 0;
+    bool first = true;
+
+    huff_default_options(&options);
+    options.blockSize = DEFAULT_BLOCK_SIZE;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") == 0) {
+            options.legacy = true;
+            options.blockSize = 0;
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            sizeList = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            jsonPath = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            options.streams = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            options.maxLength = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 &&
+                    parse_size(argv[i + 1], &value) == 0) {
+            options.blockSize = value;
+            i++;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "runs must be 1 to %d\n", MAX_RUNS);
+        return 1;
+    }
+    sizeCount = parse_sizes(sizeList, sizes);
+    if (sizeCount < 0) {
+        return 1;
+    }
+    if (jsonPath != NULL) {
+        json = fopen(jsonPath, "w");
+        if (json == NULL) {
+            perror(jsonPath);
+            return 1;
+        }
+        fprintf(json, "{\"runs\": %d, \"blockSize\": %lu, \"streams\": %d, "
+                "\"threads\": %d, \"maxLength\": %d, \"results\": [", runs,
+                (unsigned long)options.blockSize, options.streams,
+                options.threads, options.maxLength);
+    }
+
+    for (i = 0; i < sizeCount && result == 0; i++) {
+        data = malloc(sizes[i]);
+        if (data == NULL) {
+            perror("malloc");
+            result = 1;
+            break;
+        }
+        for (j = 0; j < CORPUS_COUNT; j++) {
+            if (only != NULL && strcmp(only, corpusNames[j]) != 0) {
+                continue;
+            }
+            fill_corpus(data, sizes[i], corpusNames[j]);
+            if (run_corpus(data, sizes[i], &options, runs, times,
+                            &compressed) != 0) {
+                fprintf(stderr, "%s %lu bytes failed\n", corpusNames[j],
+                        (unsigned long)sizes[i]);
+                result = 1;
+                break;
+            }
+            report_text(corpusNames[j], sizes[i], compressed, times);
+            if (json != NULL) {
+                report_json(json, corpusNames[j], sizes[i], compressed,
+                            times, first);
+                first = false;
+            }
+        }
+        free(data);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n]}\n");
+        if (fclose(json) != 0) {
+            perror(jsonPath);
+            result = 1;
+        }
+    }
+    return result;
+}
@@ -1,160 +1,238 @@
-#include "./huffman.h"
+#include "./libhuffman.h"
+#include "./parallel.h"
 #include "./functions.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/stat.h>
-#include <arpa/inet.h>
-
-#define BUFF_HEADER_SIZE 5 /* amount of chars per entry in header */
+#include <string.h>
+
+#define USAGE "usage hdecode [ -j threads [ -q blocks ] ] " \
+                "[ -r | --range offset:length | -t | --test ] " \
+                "[ -b bufsize ] [ --io sync | thread | map ] " \
+                "[ --io-depth buffers ] [ --table file ] [ --stats ] " \
+                "[ ( infile | - ) [ outfile ] " \
+                "| --batch ( files | --manifest file | -0 ) " \
+                "| --archive file ]\n"
+
+
+/* parse offset:length, each with an optional K, M or G suffix */
+static int parse_range(char* arg, uint64_t* offset, uint64_t* length) {
+    char *colon;
+    size_t value;
+    colon = strchr(arg, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+    *colon = '\0';
+    if (parse_size(arg, &value) != 0) {
+        return -1;
+    }
+    *offset = value;
+    if (parse_size(colon + 1, &value) != 0) {
+        return -1;
+    }
+    *length = value;
+    if (*offset + *length < *offset) {
+        return -1;
+    }
+    return 0;
+}
+
+/* decode a batch of files named on the command line, in a manifest or
+   NUL-separated on stdin, or every file in an archive */
+static int run_batch(const HuffOptions* options, char* files[],
+                        int fileCount, const char* manifest, bool nulList,
+                        const char* archive) {
+    char **list = NULL;
+    size_t count = fileCount;
+    int file, result;
+    if (manifest != NULL || nulList) {
+        file = manifest != NULL ? open(manifest, O_RDONLY) : STDIN_FILENO;
+        if (file == -1) {
+            perror(manifest);
+            return -1;
+        }
+        list = read_path_list(file, nulList ? '\0' : '\n', &count);
+        if (manifest != NULL) {
+            close(file);
+        }
+        if (list == NULL) {
+            perror(manifest != NULL ? manifest : "stdin");
+            return -1;
+        }
+        files = list;
+    }
+    result = archive != NULL ? huff_extract_archive(options, archive) :
+                huff_decode_batch(options, files, count);
+    free(list);
+    return result;
+}
 
 
 int main(int argc, char *argv[]) {
-    int fin, fout, i;
-    uint32_t charCountEncoded;
-    int bytesRead;
-    unsigned char buffer[BUFFER_SIZE];
-    int tableLength; /* number of unique chars */
-    uint32_t *histogram; /* pointer to array to hold histogram of occurrences*/
-    
-    HuffmanNode* head; /* pointer to head of list of huff nodes*/
-    HuffmanNode* root; /* pointer to root of code tree */
+    int fin, fout, i, fileCount, result;
+    char **files; /* infile and outfile names, or the batch */
+    HuffOptions options; /* threads, blocks in flight and buffer size */
+    HuffContext *context;
+    bool ranged = false; /* decode only part of the file */
+    bool test = false; /* decode to check the file, writing nothing */
+    uint64_t rangeOffset = 0, rangeLength = 0;
+    bool batch = false, nulList = false; /* batch mode and its lists */
+    char *manifest = NULL, *archive = NULL;
     
+    huff_default_options(&options);
+    /* names are gathered at the front of argv, behind the parsing */
+    files = argv;
+
     /* command line parsing */
-    switch(argc) {
-        case 1: /* no arguments */
-            fin = STDIN_FILENO;
-            fout = STDOUT_FILENO;
-            break;
-        case 2: /* one argument for input */
-            if (argv[1][0] == '-') { /* using stdin */
-                fin = STDIN_FILENO;
-            } else {
-                fin = open(argv[1], O_RDONLY);
-                if (fin == -1) {
-                    perror(argv[1]);
-                    return -1;
-                }     
+    fileCount = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) { /* threads */
+            if (++i == argc || (options.threads = atoi(argv[i])) < 1 ||
+                options.threads > MAX_THREADS) {
+                fprintf(stderr, "hdecode: threads must be 1 to %d\n",
+                        MAX_THREADS);
+                return -1;
             }
-            fout = STDOUT_FILENO;
-            break;
-        case 3: /* both in file and out file */
-            if (argv[1][0] == '-') { /* using stdin */
-                fin = STDIN_FILENO;
+        } else if (strcmp(argv[i], "-q") == 0) { /* blocks in flight */
+            if (++i == argc || (options.inFlight = atoi(argv[i])) < 1) {
+                fprintf(stderr, "hdecode: bad number of blocks in flight\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 || 
+                    strcmp(argv[i], "--range") == 0) { /* part to decode */
+            if (++i == argc || 
+                parse_range(argv[i], &rangeOffset, &rangeLength) != 0) {
+                fprintf(stderr, "hdecode: range must be offset:length\n");
+                return -1;
+            }
+            ranged = true;
+        } else if (strcmp(argv[i], "-t") == 0 || 
+                    strcmp(argv[i], "--test") == 0) { /* check only */
+            test = true;
+        } else if (strcmp(argv[i], "-b") == 0) { /* buffer size */
+            if (++i == argc || parse_size(argv[i], &options.bufferSize) != 0 ||
+                options.bufferSize < MIN_IO_BUFFER_SIZE) {
+                fprintf(stderr, "hdecode: bad buffer size\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--io") == 0) { /* I/O backend */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            if (strcmp(argv[i], "sync") == 0) {
+                options.io = HUFF_IO_SYNC;
+            } else if (strcmp(argv[i], "thread") == 0) {
+                options.io = HUFF_IO_THREAD;
+            } else if (strcmp(argv[i], "map") == 0) {
+                options.io = HUFF_IO_MAP;
             } else {
-                fin = open(argv[1], O_RDONLY);
-                if (fin == -1) {
-                    perror(argv[1]);
-                    return -1;
-                }     
+                fprintf(stderr, "hdecode: I/O backend must be sync, thread "
+                        "or map\n");
+                return -1;
             }
-            fout = open(argv[2], 
-                        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            if (fout == -1) {
-                perror(argv[2]);
+        } else if (strcmp(argv[i], "--io-depth") == 0) { /* I/O buffers */
+            if (++i == argc || (options.ioDepth = atoi(argv[i])) < 2 ||
+                options.ioDepth > MAX_IO_DEPTH) {
+                fprintf(stderr, "hdecode: I/O depth must be 2 to %d\n", 
+                        MAX_IO_DEPTH);
                 return -1;
             }
-            break;
-        default:
-            printf("usage hdecode [ ( infile | - ) [ outfile ] ]\n");
-            return -1;
-            break;
-    }
-
-    /* testing for empty file */
-    if (fin != STDIN_FILENO) {
-        if (file_is_empty(fin) == 0) {
-            if (fin != -1 && fout != -1) {
-                close(fin);
-                close(fout);
+            options.io = HUFF_IO_THREAD;
+        } else if (strcmp(argv[i], "--table") == 0) { /* shared table */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
             }
-            return 0;
+            options.table = argv[i];
+        } else if (strcmp(argv[i], "--stats") == 0) { /* timings */
+            options.stats = true;
+        } else if (strcmp(argv[i], "--batch") == 0) { /* many files */
+            batch = true;
+        } else if (strcmp(argv[i], "--manifest") == 0) { /* list file */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            manifest = argv[i];
+            batch = true;
+        } else if (strcmp(argv[i], "--archive") == 0) { /* single file */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            archive = argv[i];
+            batch = true;
+        } else if (strcmp(argv[i], "-0") == 0) { /* list on stdin */
+            nulList = true;
+            batch = true;
+        } else {
+            files[fileCount++] = argv[i];
         }
     }
-
-    /* reading header to build frequency table */
-    if ((bytesRead = read(fin, &buffer, 1)) > 0) {
-        tableLength = (int)buffer[0] + 1; /* add 1 because of num -1 format*/
-    }
-    
-    /*printf("size of table from header: %d\n", tableLength);*/
-
-    histogram = malloc(sizeof(uint32_t) * ASCII_TABLE_LENGTH);
-    if (histogram == NULL) {
-        perror("malloc");
-        exit(1);
+    if (batch && fileCount == 0 && manifest == NULL && !nulList &&
+            archive == NULL) {
+        printf(USAGE);
+        return -1;
     }
-    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        histogram[i] = 0;
+    if (batch) {
+        return run_batch(&options, files, fileCount, manifest, nulList,
+                            archive);
     }
-
-    charCountEncoded = 0;
-    for (i = 0; i< tableLength; i++) {
-        /* 1 byte for c; 4 bytes for count of c */
-        bytesRead = read(fin, &buffer, BUFF_HEADER_SIZE); 
-        if (bytesRead != BUFF_HEADER_SIZE) {
-            perror("buffer read");
-            exit(1);
-        }
-        /* converting 4 chars to uint32 reverting significance order*/
-        /* shift last char byte 3 times to left, 3rd byte two times, and so on*/
-        /* add them all up using logical or. Result will be the value to store 
-                                            in occurence table*/
-        histogram[(int) buffer[0]] = 
-        (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4];
-        /*   AA       BB       CC       DD
-        * AA=00000000 00000000 00000000 aaaaaaaa  (buffer[1])
-        * BB=00000000 00000000 00000000 bbbbbbbb  (buffer[2])
-        * CC=00000000 00000000 00000000 cccccccc  (buffer[3])
-        * DD=00000000 00000000 00000000 dddddddd  (buffer[4])
-        * (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]
-
-        * aaaaaaaa 00000000 00000000 00000000 <= 3 bytes (24) shift
-        * 00000000 bbbbbbbb 00000000 00000000 <= 2 bytes (16) shift
-        * 00000000 00000000 cccccccc 00000000 <= 1 byte (8) shift
-        * 00000000 00000000 00000000 dddddddd <= no shift
-        * ---------- OR sum -----------------
-        * aaaaaaaa bbbbbbbb cccccccc dddddddd */
-
-        /* to know how many characters to decode later */
-        charCountEncoded += histogram[(int) buffer[0]]; 
+    if (fileCount > 2 || (test && (fileCount > 1 || ranged))) {
+        printf(USAGE);
+        return -1;
     }
-
-    /* build code tree */
-    head = newList(); /* initialize list that holds initial nodes */
-
-
-    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        if (histogram[i] != 0) {
-            if (list_insert(&head, i, histogram[i], NULL, NULL) != 0) {
-                perror("list insert");
-                exit(1);
+    fin = STDIN_FILENO;
+    fout = STDOUT_FILENO;
+    switch(fileCount) {
+        case 0: /* no arguments */
+            break;
+        default: /* in file, and maybe out file */
+            if (files[0][0] != '-') { /* - means using stdin */
+                fin = open(files[0], O_RDONLY);
+                if (fin == -1) {
+                    perror(files[0]);
+                    return -1;
+                }     
             }
-        }
+            if (fileCount == 2) {
+                fout = open(files[1], 
+                            O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+                if (fout == -1) {
+                    perror(files[1]);
+                    return -1;
+                }
+            }
+            break;
     }
 
-    root = create_hufftree(&head); /* creating code tree */
-    if (root == NULL) {
-        perror("tree creation");
+    context = huff_context_new(&options);
+    if (context == NULL) {
+        if (errno != EINVAL) {
+            perror("malloc");
+        }
         exit(1);
     }
-    
-    if (traverse_for_characters(root, charCountEncoded, fin, fout) == -1) {
-        perror("traversing tree for characters");
-        exit(1); 
+    if (test) {
+        result = huff_test_file(context, fin);
+    } else if (ranged) {
+        result = huff_decode_file_range(context, fin, fout, rangeOffset, 
+                                        rangeLength);
+    } else {
+        result = huff_decode_file(context, fin, fout);
+    }
+    huff_context_free(context);
+    if (result == -1) {
+        exit(1);
     }
-
 
     close(fin);
     close(fout);
 
-    free(histogram);
-    if (traverse_free_memory(root, 0) != 0){
-        perror("free tree");
-        return -1;
-    };
-    free(head);
-
     return 0;
 }
\ No newline at end of file
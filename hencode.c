@@ -1,230 +1,240 @@
-#include "./huffman.h"
+#include "./libhuffman.h"
+#include "./parallel.h"
 #include "./functions.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/stat.h>
-#include <arpa/inet.h>
-
-
-#define CHAR_LENGTH 8 /* number of bits in a char*/
-#define WORKING_STRING_LENGTH 1024 /* size of block to hold 0s and 1s being
-                                                         converted*/
-
-/* utility function for writing body by converting strings to unsigned chars */
-int write_body(int fout, const char codeBits[]) {
-    int i, codeBitsloc, k;
-    int bits = strlen(codeBits); /* bit counter */
-    int bytes = bits/CHAR_LENGTH; /* byte counter */
-    unsigned char buffer = 0;
-    codeBitsloc = 0;
-    k = 0;
-    
-    while (k < bytes) {         
-        for (i = 0; i < CHAR_LENGTH; i++) { /* jump 8 at a time */
-            if (codeBits[codeBitsloc] == '1') {
-                buffer = buffer | 1 << (7 - i); 
-                /* buffer starts with 00000000 then
-                gets 1s in the corresponding position by adding 00001000 (ex.)
-                with bit level OR addition*/
-            }
-            codeBitsloc++;
+#include <string.h>
+
+
+#define USAGE "usage hencode [ -L | -l maxbits ] [ -B blocksize ] " \
+                "[ -s streams ] [ --codec huffman | ans | pairs | best ] " \
+                "[ -j threads [ -q blocks ] ] [ -i ] " \
+                "[ -c ] [ -b bufsize ] [ --io sync | thread ] " \
+                "[ --io-depth buffers ] [ --table file ] [ --stats ] " \
+                "( ( infile | - ) [ outfile ] | --batch [ --archive file ] " \
+                "( files | --manifest file | -0 ) )\n"
+
+
+/* code a batch of files named on the command line, in a manifest or
+   NUL-separated on stdin */
+static int run_batch(const HuffOptions* options, char* files[],
+                        int fileCount, const char* manifest, bool nulList,
+                        const char* archive) {
+    char **list = NULL;
+    size_t count = fileCount;
+    int file, result;
+    if (manifest != NULL || nulList) {
+        file = manifest != NULL ? open(manifest, O_RDONLY) : STDIN_FILENO;
+        if (file == -1) {
+            perror(manifest);
+            return -1;
+        }
+        list = read_path_list(file, nulList ? '\0' : '\n', &count);
+        if (manifest != NULL) {
+            close(file);
         }
-        if (write(fout, &buffer, sizeof(unsigned char)) == -1){
-            perror("body writing");
+        if (list == NULL) {
+            perror(manifest != NULL ? manifest : "stdin");
             return -1;
         }
-        buffer = 0;
-        k++;
-    }    
-    return 0; 
+        files = list;
+    }
+    result = huff_encode_batch(options, files, count, archive);
+    free(list);
+    return result;
 }
 
-int main(int argc, char *argv[]) {
-    int fin, fout, i, bytesRead, j, padCount, bytesWritten;
-    int *histogram; /* pointer array to hold histogram of occurences */
-    HuffmanNode* head; /* pointer to head of list of huffman nodes */
-    HuffmanNode* root; /* pointer to root of code tree */
-    char *codeTable[ASCII_TABLE_LENGTH]; /* array to hold translation table*/
 
-    uint8_t charNum; /* number of unique characters minus 1*/
-    uint8_t headerC; /* 1 byte for each unique character in header file */
-    uint32_t headerCcount; /* 4 bytes to hold each character's frequency */
-    off_t offset; /* offset for lseek */
-    unsigned char buffer[BUFFER_SIZE]; /* reading buffer */
-    char codeString[WORKING_STRING_LENGTH]; /* working string for conversion*/
+int main(int argc, char *argv[]) {
+    int fin, fout, i, fileCount, result;
+    char **files; /* infile and outfile names, or the batch */
+    HuffOptions options; /* what the flags ask for */
+    HuffContext *context;
+    bool batch = false, nulList = false; /* batch mode and its lists */
+    char *manifest = NULL, *archive = NULL;
 
-    /* working variables to build code table*/
-    int depth; 
-    char aux_string[MAX_CODE_LENGTH];
-    depth = 0;
-    aux_string[0] = '\0';
+    huff_default_options(&options);
+    /* names are gathered at the front of argv, behind the parsing */
+    files = argv;
 
     /* command line parsing */
-    switch(argc) {
-        case 1: /* no arguments */
-            printf("usage hencode infile [ outfile ]\n");
-            return -1;
-            break;
-        case 2: /* in file only */
-            fin = open(argv[1], O_RDONLY);
-            if (fin == -1) {
-                perror(argv[1]);
+    fileCount = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") == 0) { /* legacy format */
+            options.legacy = true;
+        } else if (strcmp(argv[i], "-l") == 0) { /* code length limit */
+            if (++i == argc || (options.maxLength = atoi(argv[i])) < 1 ||
+                options.maxLength > MAX_PACKED_CODE_LENGTH) {
+                fprintf(stderr, "hencode: code length limit must be 1 to "
+                        "%d\n", MAX_PACKED_CODE_LENGTH);
                 return -1;
             }
-            fout = STDOUT_FILENO;
-            break;
-        case 3: /* both in file and out file */
-            fin = open(argv[1], O_RDONLY);
-            if (fin == -1) {
-                perror(argv[1]);
+        } else if (strcmp(argv[i], "-B") == 0) { /* block size */
+            if (++i == argc || parse_size(argv[i], &options.blockSize) != 0 ||
+                options.blockSize == 0) {
+                fprintf(stderr, "hencode: bad block size\n");
                 return -1;
             }
-            fout = open(argv[2], 
-                        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            if (fout == -1) {
-                perror(argv[2]);
+        } else if (strcmp(argv[i], "-s") == 0) { /* streams per block */
+            if (++i == argc || (options.streams = atoi(argv[i])) < 1 ||
+                options.streams > MAX_STREAMS) {
+                fprintf(stderr, "hencode: streams must be 1 to %d\n",
+                        MAX_STREAMS);
                 return -1;
             }
-            break;
-        default:
-            printf("usage hencode infile [ outfile ]\n");
-            return -1;
-            break;
-    }
-
-    /* testing for empty file */
-    if (fin != STDIN_FILENO) {
-        if (file_is_empty(fin) == 0) {
-            if (fin != -1 && fout != -1) {
-                close(fin);
-                close(fout);
-            }
-            return 0;
-        }
-    }
-
-    /* building histogram of character occurrences */
-    histogram = countOccurrences(fin, ASCII_TABLE_LENGTH);
-
-    head = newList(); /* initialize list that holds initial nodes */
-
-    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        if (histogram[i] != 0) {
-            if (list_insert(&head, i, histogram[i], NULL, NULL) != 0){
-                perror("list insert");
-                exit(1);
+        } else if (strcmp(argv[i], "--codec") == 0) { /* block coding */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
             }
-        }
-    }
-
-    charNum = list_size(head) - 1; /* to be used for header */
-
-    root = create_hufftree(&head); /* creating code tree */
-    if(root == NULL) {
-        perror("tree creation");
-        exit(1);
-    }
-
-    /* initializing code table with pointers to NULL */
-    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        codeTable[i] = malloc(sizeof(char));
-        codeTable[i] = NULL;
-    }
-
-    /* traversing tree to write codes in codeTable */
-    if (traverse_for_codes(root, codeTable, aux_string, depth) != 0) {
-        perror("traversal");
-        exit(1);
-    }
-    
-    /* printing final htable to visualize steps */
-    /* for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        if (codeTable[i] != NULL){
-            printf("0x%02x '%c': %s\n", i, i, codeTable[i]);
-        }
-    } */
-    
-    /* writing header */
-    bytesWritten = write(fout, &charNum, sizeof(charNum));
-    if (bytesWritten == -1) {
-        perror("header write");
-        return -1;
-    }
-    
-    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
-        if (histogram[i] != 0){
-            headerC = i;
-            headerCcount = htonl(histogram[i]);
-            bytesWritten = write(fout, &headerC, sizeof(headerC));
-            if (bytesWritten == -1) {
-                perror("header write");
+            if (strcmp(argv[i], "huffman") == 0) {
+                options.codec = HUFF_CODEC_HUFFMAN;
+            } else if (strcmp(argv[i], "ans") == 0) {
+                options.codec = HUFF_CODEC_ANS;
+            } else if (strcmp(argv[i], "best") == 0) {
+                options.codec = HUFF_CODEC_BEST;
+            } else if (strcmp(argv[i], "pairs") == 0) {
+                options.codec = HUFF_CODEC_PAIRS;
+            } else {
+                fprintf(stderr, "hencode: codec must be huffman, ans, "
+                        "pairs or best\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-j") == 0) { /* threads */
+            if (++i == argc || (options.threads = atoi(argv[i])) < 1 ||
+                options.threads > MAX_THREADS) {
+                fprintf(stderr, "hencode: threads must be 1 to %d\n",
+                        MAX_THREADS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-q") == 0) { /* blocks in flight */
+            if (++i == argc || (options.inFlight = atoi(argv[i])) < 1) {
+                fprintf(stderr, "hencode: bad number of blocks in flight\n");
                 return -1;
             }
-            bytesWritten = write(fout, &headerCcount, sizeof(headerCcount));
-            if (bytesWritten == -1) {
-                perror("header write");
+        } else if (strcmp(argv[i], "-i") == 0) { /* block index */
+            options.index = true;
+        } else if (strcmp(argv[i], "-c") == 0 ||
+                    strcmp(argv[i], "--checksum") == 0) { /* block crcs */
+            options.checksum = true;
+        } else if (strcmp(argv[i], "-b") == 0) { /* buffer size */
+            if (++i == argc || parse_size(argv[i], &options.bufferSize) != 0 ||
+                options.bufferSize < MIN_IO_BUFFER_SIZE) {
+                fprintf(stderr, "hencode: bad buffer size\n");
                 return -1;
             }
+        } else if (strcmp(argv[i], "--io") == 0) { /* I/O backend */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            if (strcmp(argv[i], "sync") == 0) {
+                options.io = HUFF_IO_SYNC;
+            } else if (strcmp(argv[i], "thread") == 0) {
+                options.io = HUFF_IO_THREAD;
+            } else {
+                fprintf(stderr, "hencode: I/O backend must be sync or "
+                        "thread\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--io-depth") == 0) { /* I/O buffers */
+            if (++i == argc || (options.ioDepth = atoi(argv[i])) < 2 ||
+                options.ioDepth > MAX_IO_DEPTH) {
+                fprintf(stderr, "hencode: I/O depth must be 2 to %d\n", 
+                        MAX_IO_DEPTH);
+                return -1;
+            }
+            options.io = HUFF_IO_THREAD;
+        } else if (strcmp(argv[i], "--table") == 0) { /* shared table */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            options.table = argv[i];
+        } else if (strcmp(argv[i], "--stats") == 0) { /* timings */
+            options.stats = true;
+        } else if (strcmp(argv[i], "--batch") == 0) { /* many files */
+            batch = true;
+        } else if (strcmp(argv[i], "--manifest") == 0) { /* list file */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            manifest = argv[i];
+            batch = true;
+        } else if (strcmp(argv[i], "--archive") == 0) { /* single file */
+            if (++i == argc) {
+                printf(USAGE);
+                return -1;
+            }
+            archive = argv[i];
+            batch = true;
+        } else if (strcmp(argv[i], "-0") == 0) { /* list on stdin */
+            nulList = true;
+            batch = true;
+        } else {
+            files[fileCount++] = argv[i];
         }
-    }    
-
-    offset = lseek(fin, 0, SEEK_SET); /* seek beginning of file for re-read */
-    if (offset == -1) {
-        perror("lseek");
-        return -1;    
     }
-
-    /* writing body */
-    codeString[0] = '\0';
-    padCount = 0;
-    while (( bytesRead = read(fin, &buffer, BUFFER_SIZE) ) != 0) {
-        if (bytesRead == -1) {
-            perror("read buffer");
+    if (batch && fileCount == 0 && manifest == NULL && !nulList) {
+        printf(USAGE);
+        return -1;
+    }
+    if (batch) {
+        return run_batch(&options, files, fileCount, manifest, nulList,
+                            archive);
+    }
+    if (fileCount > 2) {
+        printf(USAGE);
+        return -1;
+    }
+    switch(fileCount) {
+        case 0: /* no arguments */
+            printf(USAGE);
             return -1;
-        }
-        for (i=0; i<bytesRead; i++) {
-            strcat(codeString, codeTable[buffer[i]]);
-            /* case of last byte of final buffer*/
-            
-            if (strlen(codeString)%CHAR_LENGTH == 0) { /* everytime the string 
-                        length is a multiple of 8 it can be converted*/
-                if (write_body(fout, codeString) == -1) {
-                    perror("write body");
+            break;
+        default: /* in file, and maybe out file */
+            if (strcmp(files[0], "-") == 0) { /* stdin can only stream */
+                fin = STDIN_FILENO;
+                if (options.blockSize == 0) {
+                    options.blockSize = DEFAULT_BLOCK_SIZE;
+                }
+            } else {
+                fin = open(files[0], O_RDONLY);
+                if (fin == -1) {
+                    perror(files[0]);
                     return -1;
                 }
-                codeString[0] = '\0';
             }
-        }
+            if (fileCount == 1) {
+                fout = STDOUT_FILENO;
+            } else {
+                fout = open(files[1], 
+                            O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+                if (fout == -1) {
+                    perror(files[1]);
+                    return -1;
+                }
+            }
+            break;
     }
-    /* case of last byte of last buffer */
-    if ((bytesRead == 0) && (strlen(codeString) > 0)) { 
-        /* calculate amount of padding */
-        padCount = (CHAR_LENGTH - 
-                    (strlen(codeString) % CHAR_LENGTH)) % CHAR_LENGTH; 
-        for (j = 0; j < padCount; j++) {
-            strcat(codeString, "0");
-        }
-        if(write_body(fout, codeString) == -1){
-            perror("write padding");
-            return -1;
+
+    context = huff_context_new(&options);
+    if (context == NULL) {
+        if (errno != EINVAL) {
+            perror("malloc");
         }
-        codeString[0] = '\0';
+        return -1;
     }
+    result = huff_encode_file(context, fin, fout);
+    huff_context_free(context);
 
     /* close files */
     close(fin);
     close(fout);
-
-    /* frees */
-    free(histogram);
-
-    for(i=0; i < ASCII_TABLE_LENGTH; i++) {
-        free(codeTable[i]);
-    }
-
-    /* huffman nodes freed up inside traversal routine */
-
-    return 0;
-}
\ No newline at end of file
+    return result;
+}
@@ -0,0 +1,87 @@
+#include "./huffman.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BYTES (64 * 1024 * 1024) /* size of each generated input */
+#define BENCH_ROUNDS 8 /* passes timed per kernel and input */
+
+
+/* the one-table loop count_bytes replaced, kept for comparison */
+static void count_naive(uint64_t totals[], const unsigned char* data,
+                        size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        totals[data[i]]++;
+    }
+}
+
+/* deterministic xorshift generator so runs compare across machines */
+static uint32_t next_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* uniform bytes, bytes mostly from a few characters, or one long run */
+static void fill_input(unsigned char* data, size_t n, const char* kind) {
+    static const unsigned char common[] = "etaoin";
+    size_t i;
+    uint32_t state = 2463534242U, r;
+    for (i = 0; i < n; i++) {
+        r = next_random(&state);
+        if (strcmp(kind, "uniform") == 0) {
+            data[i] = r;
+        } else if (strcmp(kind, "skewed") == 0) {
+            /* three in four bytes from six characters, like text */
+            data[i] = (r & 0xff) < 0xc0 ? common[(r >> 8) % 6] :
+                        (unsigned char)(r >> 24);
+        } else {
+            data[i] = 'x';
+        }
+    }
+}
+
+/* GB/s of kernel over data, best of BENCH_ROUNDS */
+static double measure(void (*kernel)(uint64_t[], const unsigned char*,
+                        size_t), const unsigned char* data, size_t n) {
+    uint64_t totals[ASCII_TABLE_LENGTH];
+    clock_t start;
+    double seconds, best = 0;
+    int round;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        memset(totals, 0, sizeof(totals));
+        start = clock();
+        kernel(totals, data, n);
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (totals[data[0]] == 0) { /* keeps the counts live */
+            return 0;
+        }
+        if (round == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best > 0 ? n / best / 1e9 : 0;
+}
+
+int main(void) {
+    const char *kinds[] = { "uniform", "skewed", "run" };
+    unsigned char *data;
+    int i;
+    data = malloc(BENCH_BYTES);
+    if (data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    printf("%-8s %12s %12s\n", "input", "naive", "lanes");
+    for (i = 0; i < 3; i++) {
+        fill_input(data, BENCH_BYTES, kinds[i]);
+        printf("%-8s %7.2f GB/s %7.2f GB/s\n", kinds[i],
+                measure(count_naive, data, BENCH_BYTES),
+                measure(count_bytes, data, BENCH_BYTES));
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "./libhuffman.h"
+#include "./huffman.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string.h>
+
+
+#define USAGE "usage htrain [ -l maxbits ] tablefile ( sample | - ) ...\n"
+#define MAX_SAMPLES 1024 /* sample files read for one table */
+
+
+int main(int argc, char *argv[]) {
+    int samples[MAX_SAMPLES]; /* open sample files */
+    int i, sampleCount, fout, result;
+    char *table = NULL; /* name of the table file */
+    HuffOptions options; /* for the default code length limit */
+
+    huff_default_options(&options);
+
+    /* command line parsing */
+    sampleCount = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) { /* code length limit, 256 codes
+                                               need at least 8 bits */
+            if (++i == argc || (options.maxLength = atoi(argv[i])) < 8 ||
+                options.maxLength > MAX_PACKED_CODE_LENGTH) {
+                fprintf(stderr, "htrain: code length limit must be 8 to "
+                        "%d\n", MAX_PACKED_CODE_LENGTH);
+                return -1;
+            }
+        } else if (table == NULL) {
+            table = argv[i];
+        } else if (sampleCount == MAX_SAMPLES) {
+            fprintf(stderr, "htrain: at most %d samples\n", MAX_SAMPLES);
+            return -1;
+        } else if (strcmp(argv[i], "-") == 0) {
+            samples[sampleCount++] = STDIN_FILENO;
+        } else if ((samples[sampleCount++] = open(argv[i], O_RDONLY)) == -1) {
+            perror(argv[i]);
+            return -1;
+        }
+    }
+    if (sampleCount == 0) {
+        printf(USAGE);
+        return -1;
+    }
+    fout = open(table, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fout == -1) {
+        perror(table);
+        return -1;
+    }
+
+    result = huff_train_table(samples, sampleCount, fout, options.maxLength);
+
+    /* close files */
+    for (i = 0; i < sampleCount; i++) {
+        close(samples[i]);
+    }
+    close(fout);
+    return result;
+}
@@ -7,255 +7,798 @@
 #include <stdint.h>
 #include "./huffman.h"
 #include "./functions.h"
+#include "./stats.h"
 
 
-/* implements huffman node precedence rule */
-bool AprecedesB(HuffmanNode* a, HuffmanNode* b) {
-    if (a->frequency == b->frequency) { /* tiebreak case */
-        return (a->asciiValue < b->asciiValue); /* lower character wins */
-                    /* when a and b identical supernodes, new node goes left */
-    } else {
-        return (a->frequency < b->frequency);
-    }
+/* check if node at the end of tree */
+bool node_is_leaf(const HuffmanNode* node) {
+    return node->left < 0;
 }
 
-/* check if node at the end of tree */
-bool node_is_leaf(HuffmanNode* node) {
-    if ((node->left == NULL) && (node->right == NULL)) {
-        return true;
+/* add the characters of a buffer to 64-bit totals. Counts go to
+   COUNT_LANES interleaved 32-bit sub-histograms, eight bytes per load,
+   so a run of one character does not wait on its own previous store;
+   the lanes are summed into totals every COUNT_CHUNK bytes */
+void count_bytes(uint64_t totals[], const unsigned char* data, size_t n) {
+    uint32_t lanes[COUNT_LANES][ASCII_TABLE_LENGTH];
+    uint64_t word;
+    size_t i, chunk;
+    int c, lane;
+    if (n < COUNT_LANES * ASCII_TABLE_LENGTH) { /* lanes cost more to sum */
+        for (i = 0; i < n; i++) {
+            totals[data[i]]++;
+        }
+        return;
+    }
+    while (n > 0) {
+        chunk = n < COUNT_CHUNK ? n : COUNT_CHUNK;
+        memset(lanes, 0, sizeof(lanes));
+        for (i = 0; i + 8 <= chunk; i += 8) {
+            memcpy(&word, data + i, 8);
+            lanes[0][word & 0xff]++;
+            lanes[1][(word >> 8) & 0xff]++;
+            lanes[2][(word >> 16) & 0xff]++;
+            lanes[3][(word >> 24) & 0xff]++;
+            lanes[0][(word >> 32) & 0xff]++;
+            lanes[1][(word >> 40) & 0xff]++;
+            lanes[2][(word >> 48) & 0xff]++;
+            lanes[3][word >> 56]++;
+        }
+        for (; i < chunk; i++) {
+            lanes[0][data[i]]++;
+        }
+        for (c = 0; c < ASCII_TABLE_LENGTH; c++) {
+            for (lane = 0; lane < COUNT_LANES; lane++) {
+                totals[c] += lanes[lane][c];
+            }
+        }
+        data += chunk;
+        n -= chunk;
     }
-    return false;
 }
 
-/* build histogram for char frequency from file */
-int *countOccurrences(int file, int size) {
-    int bytesRead, i;
-    unsigned char buffer[BUFFER_SIZE];
-    int *array = malloc(sizeof(int) * size);
-    for (i = 0; i < size; i++) { /* zero out histogram */
-        array[i] = 0;
+/* build histogram for char frequency from file, NULL on error */
+uint64_t *countOccurrences(BufReader* in, int size) {
+    ssize_t bytesRead;
+    double start;
+    uint64_t *array = calloc(size, sizeof(uint64_t));
+    if (array == NULL) {
+        return NULL;
     }
-    while (( bytesRead = read(file, &buffer, BUFFER_SIZE) ) > 0) { 
-        for (i =0; i < bytesRead; i++) {
-            array[buffer[i]]++;
-        }
-        
+    while (( bytesRead = buf_fill(in) ) > 0) { 
+        start = stats_clock();
+        count_bytes(array, in->data + in->next, bytesRead);
+        stats_phase(STAT_HISTOGRAM, start);
+        in->next = in->end;
+    }
+    if (bytesRead == -1) {
+        free(array);
+        return NULL;
     }
     return array;
 }
 
-/* initilization for list of nodes */
-HuffmanNode* newList() {
-    HuffmanNode* head = NULL;
-    return head;
+/* implements huffman node precedence rule for the heap: lower frequency
+   first; at equal frequency supernodes come before characters, newer
+   supernodes before older ones, and characters in ascending order */
+static bool AprecedesB(const HuffmanNode* nodes, const int rank[], 
+                        int a, int b) {
+    if (nodes[a].frequency == nodes[b].frequency) { /* tiebreak case */
+        return (rank[a] < rank[b]);
+    } else {
+        return (nodes[a].frequency < nodes[b].frequency);
+    }
+}
+
+/* restore heap order below position i */
+static void heap_sift_down(int heap[], int size, const HuffmanNode* nodes,
+                            const int rank[], int i) {
+    int child, top = heap[i];
+    while ((child = 2 * i + 1) < size) {
+        if (child + 1 < size && 
+            AprecedesB(nodes, rank, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!AprecedesB(nodes, rank, heap[child], top)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
 }
 
-/* insert new node in tree with auto sort according to huffman standards */
-int list_insert(HuffmanNode** head, int ascii, int freq,
-                 HuffmanNode* left, HuffmanNode* right) {
-    HuffmanNode* newNode = (HuffmanNode*)malloc(sizeof(HuffmanNode));
-    HuffmanNode* current; /* current is used for sorting swaps*/
-    newNode->asciiValue = ascii;
-    newNode->frequency = freq;
-    newNode->left = left;
-    newNode->right = right;
-    newNode->prev = NULL;
-    newNode->next = NULL;
-    
-    /* case of empty list*/
-    if (*head == NULL) {
-        *head = newNode;
+/* tree creation logic: binary heap over the tree's array of nodes,
+   leaves first and supernodes after them; merges in the same order the
+   sorted list of nodes used to. Nothing is allocated */
+int create_hufftree(const uint64_t histogram[], HuffTree* tree) {
+    int i, leafCount, nodeCount, heapSize, left, right;
+    int heap[ASCII_TABLE_LENGTH];
+    int rank[MAX_TREE_NODES]; /* tiebreak order for equal freqs */
+    HuffmanNode *nodes = tree->nodes;
+
+    tree->root = -1;
+    tree->leafCount = 0;
+    nodeCount = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (histogram[i] != 0) {
+            nodes[nodeCount].asciiValue = i;
+            nodes[nodeCount].frequency = histogram[i];
+            nodes[nodeCount].left = -1;
+            nodes[nodeCount].right = -1;
+            rank[nodeCount] = i;
+            heap[nodeCount] = nodeCount;
+            nodeCount++;
+        }
+    }
+    leafCount = nodeCount;
+    if (leafCount == 0) {
         return 0;
     }
+    heapSize = leafCount;
+    for (i = heapSize / 2 - 1; i >= 0; i--) {
+        heap_sift_down(heap, heapSize, nodes, rank, i);
+    }
+
+    while (heapSize > 1) {
+        left = heap[0]; /* two lowest nodes */
+        heap[0] = heap[--heapSize];
+        heap_sift_down(heap, heapSize, nodes, rank, 0);
+        right = heap[0];
 
-    current = *head;
-    /* positioning new node in list using doubly linked list logic */
-    /*incrementing and scanning for precedence*/
-    while (current->next != NULL && AprecedesB(current, newNode)) {
-        current = current->next;
-    }
-    /* once precedence rule breaks, insert node in new location */
-    if (!AprecedesB(current, newNode)) { 
-        /* insert new node in the middle */
-        newNode->prev = current->prev;
-        newNode->next = current;
-        
-        if (current->prev != NULL) { /* if not head */
-            current->prev->next = newNode;
-        } else { /* if head */
-            (*head) = newNode;
-        }
-        current->prev = newNode; /* inserting to the left of reference */
-    } else { /* reached end of the list, new node to the end */
-        newNode->prev = current;
-        newNode->next = NULL;
-        current->next = newNode;
+        nodes[nodeCount].asciiValue = -1; /* supernode */
+        nodes[nodeCount].frequency = nodes[left].frequency + 
+                                        nodes[right].frequency;
+        nodes[nodeCount].left = left;
+        nodes[nodeCount].right = right;
+        rank[nodeCount] = -1 - nodeCount; /* newest supernode wins ties */
+        heap[0] = nodeCount; /* takes right's place, one sift restores */
+        heap_sift_down(heap, heapSize, nodes, rank, 0);
+        nodeCount++;
     }
+    /* last node left in the heap is the root of tree */
+    tree->root = heap[0];
+    tree->leafCount = leafCount;
     return 0;
 }
 
-/* remove node from top of list and returns its pointer */
-HuffmanNode* list_pop(HuffmanNode** head) {
-    HuffmanNode* top;
-    HuffmanNode* next;
-    if (*head == NULL) {
-        return NULL;
+/* tree traversal to record each character's code as an integer, returns
+   the depth of the deepest leaf; bits are only meaningful for codes of at
+   most MAX_PACKED_CODE_LENGTH bits */
+static int traverse_for_bits(const HuffmanNode* nodes, int node, 
+                                HuffCode codes[], uint64_t bits, int depth) {
+    int leftDepth, rightDepth;
+    if (node_is_leaf(&nodes[node])) {
+        codes[nodes[node].asciiValue].bits = bits;
+        codes[nodes[node].asciiValue].length = depth;
+        return depth;
+    }
+    /* assign 0 to left and 1 to right */
+    leftDepth = traverse_for_bits(nodes, nodes[node].left, codes, 
+                                    bits << 1, depth+1);
+    rightDepth = traverse_for_bits(nodes, nodes[node].right, codes, 
+                                    (bits << 1) | 1, depth+1);
+    return leftDepth > rightDepth ? leftDepth : rightDepth;
+}
+
+/* fill integer code table from tree, absent characters get length 0;
+   returns the longest code length */
+int build_code_table(const HuffTree* tree, HuffCode codes[]) {
+    int i;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        codes[i].bits = 0;
+        codes[i].length = 0;
     }
-    top = *head;
-    next = (*head)->next;
-    if (next != NULL) {
-        next->prev = NULL;
+    if (tree->root < 0) {
+        return 0;
     }
-    *head = next;
-    return top;
+    return traverse_for_bits(tree->nodes, tree->root, codes, 0, 0);
 }
 
-/* utility function to check size of list of nodes */
-int list_size(HuffmanNode* head) {
-    int count = 0;
-    HuffmanNode* current = head;
-    while (current != NULL) {
-        count++;
-        current = current->next;
+/* sort helper for package-merge: weight ascending, then character */
+static int compare_weights(const uint64_t histogram[], int a, int b) {
+    if (histogram[a] != histogram[b]) {
+        return histogram[a] < histogram[b] ? -1 : 1;
     }
-    return count;
+    return a - b;
 }
 
-/* utility function to echo contents of node in list */
-void list_print(HuffmanNode* head) {
-  HuffmanNode* current = head;
-  while (current != NULL) {
-    printf("%d - %#04x('%c') %d\n", current->asciiValue, current->asciiValue,
-                                     current->asciiValue, current->frequency);
-    current = current->next;
-  }
-  printf("\n");
+/* replace code lengths by optimal ones of at most maxLength bits using
+   package-merge; -1 if maxLength is too short for the alphabet */
+int limit_code_lengths(const uint64_t histogram[], HuffCode codes[],
+                        int maxLength) {
+    int i, j, n, level, itemCount, packageCount, leafPos, selected, leaves;
+    int order[ASCII_TABLE_LENGTH]; /* present characters, lightest first */
+    uint64_t *weights; /* items of the current level */
+    uint64_t *packages; /* pairs of items of the deeper level */
+    unsigned char *isPackage; /* [level][item] composition of each list */
+    const int maxItems = 2 * ASCII_TABLE_LENGTH;
+
+    n = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (histogram[i] != 0) {
+            /* insertion sort, at most 256 characters */
+            for (j = n; j > 0 && compare_weights(histogram, i, 
+                                                    order[j - 1]) < 0; j--) {
+                order[j] = order[j - 1];
+            }
+            order[j] = i;
+            n++;
+        }
+    }
+    if (n <= 1) {
+        return 0; /* lengths of 0 or 1 characters need no limit */
+    }
+    if (maxLength < 1 || maxLength > MAX_PACKED_CODE_LENGTH || 
+        (maxLength < 16 && (1 << maxLength) < n)) {
+        return -1;
+    }
+
+    weights = malloc(sizeof(uint64_t) * maxItems);
+    packages = malloc(sizeof(uint64_t) * maxItems);
+    isPackage = malloc(maxItems * (maxLength + 1));
+    if (weights == NULL || packages == NULL || isPackage == NULL) {
+        free(weights);
+        free(packages);
+        free(isPackage);
+        return -1;
+    }
+
+    /* deepest level holds only the leaves; each level above merges the
+       leaves with the pairs of the level below */
+    itemCount = 0;
+    for (i = 0; i < n; i++) {
+        weights[itemCount] = histogram[order[i]];
+        isPackage[maxLength * maxItems + itemCount] = 0;
+        itemCount++;
+    }
+    for (level = maxLength - 1; level >= 1; level--) {
+        packageCount = itemCount / 2;
+        for (i = 0; i < packageCount; i++) {
+            packages[i] = weights[2 * i] + weights[2 * i + 1];
+        }
+        itemCount = 0;
+        leafPos = 0;
+        j = 0;
+        while (leafPos < n || j < packageCount) {
+            if (j == packageCount || (leafPos < n && 
+                (uint64_t)histogram[order[leafPos]] <= packages[j])) {
+                weights[itemCount] = histogram[order[leafPos++]];
+                isPackage[level * maxItems + itemCount] = 0;
+            } else {
+                weights[itemCount] = packages[j++];
+                isPackage[level * maxItems + itemCount] = 1;
+            }
+            itemCount++;
+        }
+    }
+
+    /* the 2n-2 lightest items of the top level form the code; a leaf
+       selected on a level adds one bit to its character's length, and
+       the selected packages select twice as many items one level down */
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        codes[i].length = 0;
+    }
+    selected = 2 * n - 2;
+    for (level = 1; level <= maxLength && selected > 0; level++) {
+        leaves = 0;
+        packageCount = 0;
+        for (i = 0; i < selected; i++) {
+            if (isPackage[level * maxItems + i]) {
+                packageCount++;
+            } else {
+                leaves++;
+            }
+        }
+        for (i = 0; i < leaves; i++) { /* leaves come lightest first */
+            codes[order[i]].length++;
+        }
+        selected = 2 * packageCount;
+    }
+    free(weights);
+    free(packages);
+    free(isPackage);
+    return 0;
 }
 
-/* tree creation logic, returns root of tree */
-HuffmanNode* create_hufftree(HuffmanNode** head) {
-    int ascii;
-    int freq;
-    HuffmanNode *left, *right;
-    if (*head == NULL) {
-        return NULL;
+/* move every whole byte of the accumulator into the sink's buffer, 
+   flushing the sink once it has no room left for another 8-byte store */
+static int bit_flush_bytes(BitWriter* writer) {
+    unsigned char *p = writer->sink->data + writer->sink->count;
+    uint64_t bits = writer->buffer;
+    /* full 8-byte store, only the whole bytes are kept */
+    p[0] = bits >> 56; p[1] = bits >> 48; p[2] = bits >> 40; p[3] = bits >> 32;
+    p[4] = bits >> 24; p[5] = bits >> 16; p[6] = bits >> 8; p[7] = bits;
+    writer->sink->count += writer->count >> 3;
+    writer->buffer <<= writer->count & ~7;
+    writer->count &= 7;
+    if (writer->sink->count + 8 > writer->sink->size) {
+        return buf_flush(writer->sink);
     }
-    while (list_size(*head) > 1) {
-        left = list_pop(head); 
-        right = list_pop(head);
-        ascii = -1; /* supernode assign value lower than any real 
-                        character for tiebreak procedure */
-        freq = left->frequency + right->frequency; /* sum of frequencies*/
-        list_insert(head, ascii, freq, left, right); /* add node to list */
-        /* list_print(*head);*/
-    }
-    /* last node left in the list is the root of tree */
-    return list_pop(head);
+    return 0;
 }
 
-/* utility function to write temp code string into codeTable */
-int record_code(int ascii, char** codetable, char* auxString, int depth) {
-    int i;
-    char code[256];
-    for (i = 0; i<depth; i++) { 
-        code[i] = auxString[i]; 
-    }
-    code[depth] = '\0';
-    /* printf("0x%02x: %s\n", ascii, code);*/
-    codetable[ascii] = realloc(codetable[ascii], sizeof(char)*(strlen(code)+1));
-    if (codetable[ascii] == NULL) {
-        perror("realloc");
+/* initialize empty bit accumulator for sink */
+void bit_writer_init(BitWriter* writer, BufWriter* sink) {
+    writer->buffer = 0;
+    writer->count = 0;
+    writer->sink = sink;
+}
+
+/* append one code of up to MAX_PACKED_CODE_LENGTH bits */
+int bit_write(BitWriter* writer, uint64_t bits, int length) {
+    if (writer->count + length > 63 && bit_flush_bytes(writer) == -1) {
+        return -1;
+    }
+    if (length > 0) {
+        writer->buffer |= bits << (64 - writer->count - length);
+        writer->count += length;
+    }
+    return 0;
+}
+
+/* append the code of every character of in to the bitstream */
+int encode_buffer(const HuffCode codes[], const unsigned char* in, size_t n,
+                    BitWriter* writer) {
+    size_t i;
+    int length;
+    uint64_t buffer = writer->buffer;
+    int count = writer->count;
+    for (i = 0; i < n; i++) {
+        length = codes[in[i]].length;
+        if (count + length > 63) { /* make room, whole bytes go out */
+            writer->buffer = buffer;
+            writer->count = count;
+            if (bit_flush_bytes(writer) == -1) {
+                return -1;
+            }
+            buffer = writer->buffer;
+            count = writer->count;
+        }
+        if (length > 0) {
+            buffer |= codes[in[i]].bits << (64 - count - length);
+            count += length;
+        }
+    }
+    writer->buffer = buffer;
+    writer->count = count;
+    return 0;
+}
+
+/* pad the last byte with 0s and hand every bit over to the sink */
+int bit_writer_finish(BitWriter* writer) {
+    unsigned char last;
+    if (bit_flush_bytes(writer) == -1) {
         return -1;
     }
-    strcpy(codetable[ascii], code);
+    if (writer->count > 0) { /* partial byte, low bits already 0 */
+        last = writer->buffer >> 56;
+        writer->buffer = 0;
+        writer->count = 0;
+        return buf_write(writer->sink, &last, 1);
+    }
     return 0;
 }
 
-/* tree traversal to create huffman code for each character node */
-int traverse_for_codes(HuffmanNode* root, char* codetable[], 
-                        char* auxString, int depth) {
-    /* assign 0 to left and enter recursion */
-    if (root->left) {
-        auxString[depth] = '0';
-        traverse_for_codes(root->left, codetable, auxString, depth+1);
+/* renumber codes canonically: shorter codes first, ties by character,
+   consecutive values within one length; only the lengths are kept */
+void assign_canonical_codes(HuffCode codes[]) {
+    int i, length;
+    uint64_t code;
+    int lengthCount[MAX_PACKED_CODE_LENGTH + 1];
+    uint64_t nextCode[MAX_PACKED_CODE_LENGTH + 1];
+    for (i = 0; i <= MAX_PACKED_CODE_LENGTH; i++) {
+        lengthCount[i] = 0;
     }
-    /* assign 1 to right and enter recursion */
-    if (root->right) {
-        auxString[depth] = '1';
-        traverse_for_codes(root->right, codetable, auxString, depth+1);
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        lengthCount[codes[i].length]++;
     }
-    /* if node is leaf record code string in codeTable*/
-    if (node_is_leaf(root)) {
-        if (record_code(root->asciiValue, codetable, auxString, depth) != 0) {
-            perror("record code");
-            exit(1);
+    code = 0;
+    lengthCount[0] = 0;
+    for (length = 1; length <= MAX_PACKED_CODE_LENGTH; length++) {
+        code = (code + lengthCount[length - 1]) << 1;
+        nextCode[length] = code;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (codes[i].length > 0) {
+            codes[i].bits = nextCode[codes[i].length]++;
         }
-        free(root); /* huffman node is no longer needed */
+    }
+}
+
+/* number of bits the body takes before padding, from histogram and codes */
+uint64_t encoded_body_bits(const uint64_t histogram[],
+                            const HuffCode codes[]) {
+    int i;
+    uint64_t bits = 0;
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        bits += histogram[i] * codes[i].length;
+    }
+    return bits;
+}
+
+/* build multi-bit lookup table from integer codes, plus a flat tree for
+   the codes longer than the table; returns -1 if codes are not prefix-free */
+int build_decode_table(const HuffCode codes[], DecodeTable* table) {
+    int i, b, bit, node, nodeCount, used, rest, first;
+    int16_t child;
+    DecodeEntry *entry;
+    unsigned char firstSymbol[1 << DECODE_TABLE_BITS];
+    uint8_t firstBits[1 << DECODE_TABLE_BITS]; /* 0 when no short code */
+    const int mask = (1 << DECODE_TABLE_BITS) - 1;
+
+    memset(firstBits, 0, sizeof(firstBits));
+    for (i = 0; i < (1 << DECODE_TABLE_BITS); i++) {
+        table->entries[i].node = -1; /* bits lead nowhere until filled */
+    }
+    /* flat tree of the long codes: node 0 is the root of the bits after
+       the table prefix, child 0 means no node yet */
+    memset(table->tree, 0, sizeof(table->tree));
+    nodeCount = 0;
+    table->maxLength = 0;
+
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (codes[i].length == 0) {
+            continue;
+        }
+        if (codes[i].length > MAX_PACKED_CODE_LENGTH) {
+            return -1;
+        }
+        if (codes[i].length > table->maxLength) {
+            table->maxLength = codes[i].length;
+        }
+        if (codes[i].length <= DECODE_TABLE_BITS) {
+            /* short code: every slot starting with it */
+            first = codes[i].bits << (DECODE_TABLE_BITS - codes[i].length);
+            for (b = 0; b < (1 << (DECODE_TABLE_BITS - codes[i].length)); 
+                    b++) {
+                if (firstBits[first + b] != 0) {
+                    return -1; /* two codes share a prefix */
+                }
+                firstSymbol[first + b] = i;
+                firstBits[first + b] = codes[i].length;
+            }
+            continue;
+        }
+        /* long code: table prefix picks a tree, the rest walks it */
+        entry = &table->entries[codes[i].bits >> 
+                                (codes[i].length - DECODE_TABLE_BITS)];
+        if (entry->node < 0) {
+            if (nodeCount >= ASCII_TABLE_LENGTH) {
+                return -1; /* more internal nodes than a full tree */
+            }
+            entry->node = nodeCount++;
+        }
+        node = entry->node;
+        for (b = codes[i].length - DECODE_TABLE_BITS - 1; b >= 0; b--) {
+            bit = (codes[i].bits >> b) & 1;
+            child = table->tree[node][bit];
+            if (child < 0) {
+                return -1; /* code runs through another character's leaf */
+            }
+            if (b == 0) {
+                if (child != 0) {
+                    return -1; /* code is a prefix of another code */
+                }
+                table->tree[node][bit] = -(i + 1);
+            } else if (child == 0) {
+                if (nodeCount >= ASCII_TABLE_LENGTH) {
+                    return -1;
+                }
+                table->tree[node][bit] = nodeCount;
+                node = nodeCount++;
+            } else {
+                node = child;
+            }
+        }
+    }
+
+    /* each slot chains as many whole short codes as its bits contain */
+    for (i = 0; i < (1 << DECODE_TABLE_BITS); i++) {
+        entry = &table->entries[i];
+        entry->count = 0;
+        entry->bits = DECODE_TABLE_BITS;
+        if (firstBits[i] == 0) {
+            continue; /* long code prefix, or -1 from the fill above */
+        }
+        if (entry->node >= 0) {
+            return -1; /* short code is a prefix of a long one */
+        }
+        entry->node = 0;
+        used = 0;
+        while (entry->count < DECODE_MAX_SYMBOLS) {
+            rest = (i << used) & mask;
+            if (firstBits[rest] == 0 || 
+                firstBits[rest] > DECODE_TABLE_BITS - used) {
+                break;
+            }
+            entry->symbols[entry->count++] = firstSymbol[rest];
+            used += firstBits[rest];
+        }
+        entry->bits = used;
     }
     return 0;
 }
 
-int traverse_free_memory(HuffmanNode* root, int depth) {
-    /* go left and enter recursion */
-    if (root->left) {
-        traverse_free_memory(root->left, depth+1);
+/* top up bit buffer to at least MAX_PACKED_CODE_LENGTH+1 bits while input
+   lasts, returns -1 on read error */
+static int bit_refill(BitReader* reader) {
+    ssize_t bytesRead;
+    const unsigned char *p;
+    BufReader *in = reader->source;
+    if (in->end - in->next >= 8 && reader->limit >= 8) { 
+        /* fast path: one 8-byte load */
+        p = in->data + in->next;
+        reader->buffer |= (((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                           ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                           ((uint64_t)p[6] << 8) | (uint64_t)p[7])
+                           >> reader->count;
+        in->next += (63 - reader->count) >> 3;
+        reader->limit -= (63 - reader->count) >> 3;
+        reader->count |= 56;
+        return 0;
     }
-    /* go right and enter recursion */
-    if (root->right) {
-        traverse_free_memory(root->right, depth+1);
+    while (reader->count <= MAX_PACKED_CODE_LENGTH && reader->limit > 0) {
+        if (in->next == in->end) {
+            bytesRead = buf_fill(in);
+            if (bytesRead <= 0) {
+                return bytesRead; /* at end of input buffer keeps the rest */
+            }
+            if (bytesRead >= 8 && reader->limit >= 8) {
+                return bit_refill(reader);
+            }
+        }
+        reader->buffer |= (uint64_t)in->data[in->next++] << 
+                            (56 - reader->count);
+        reader->count += 8;
+        reader->limit--;
     }
-    /* if node is leaf, free memory */
-    if (node_is_leaf(root)) {
-        free(root); /* huffman node is no longer needed */
+    return 0;
+}
+
+/* write count copies of a character, body of a one-character alphabet */
+int decode_fill(int symbol, uint64_t count, BufWriter* out) {
+    size_t fill;
+    while (count > 0) {
+        if (out->count == out->size && buf_flush(out) == -1) {
+            perror("write");
+            return -1;
+        }
+        fill = out->size - out->count;
+        if (fill > count) {
+            fill = count;
+        }
+        memset(out->data + out->count, symbol, fill);
+        out->count += fill;
+        count -= fill;
     }
     return 0;
 }
 
-int traverse_for_characters(HuffmanNode* root, uint32_t charCountEncoded, 
-                            int filein, int fileout) {
-    uint32_t charCountDecoded = 0;
-    int bytesRead, i;
-    unsigned char buffer;
-    char eightBitString[9];
-    HuffmanNode *current;
-    current = root;
-    
+/* finish a code longer than the table: skip the table bits and walk the
+   flat tree from the node entry points to; returns the character, or -1
+   when the bits match no code or run out */
+static int decode_long_code(const DecodeTable* table, 
+                            const DecodeEntry* entry, BitReader* reader) {
+    int node = entry->node;
+    if (node < 0 || reader->count < DECODE_TABLE_BITS) {
+        return -1;
+    }
+    reader->buffer <<= DECODE_TABLE_BITS;
+    reader->count -= DECODE_TABLE_BITS;
+    while (node >= 0) {
+        if (reader->count == 0 || 
+            (node = table->tree[node][reader->buffer >> 63]) == 0) {
+            return -1;
+        }
+        reader->buffer <<= 1;
+        reader->count--;
+    }
+    return -node - 1;
+}
+
+/* decode count characters of a body that takes bodyLength bytes, one table
+   hit per up to DECODE_MAX_SYMBOLS characters; codes longer than 
+   DECODE_TABLE_BITS finish bit by bit on the flat tree */
+int decode_body(const DecodeTable* table, uint64_t charCountEncoded,
+                uint64_t bodyLength, BufReader* in, BufWriter* out) {
+    uint64_t charCountDecoded = 0;
+    int i, symbol, result;
+    unsigned char *outData;
+    size_t outCount, outLimit;
+    const DecodeEntry *entry;
+    BitReader reader;
+
+    reader.buffer = 0;
+    reader.count = 0;
+    reader.source = in;
+    reader.limit = bodyLength;
+    /* characters go straight into the writer's buffer */
+    outData = out->data;
+    outCount = out->count;
+    outLimit = out->size - DECODE_MAX_SYMBOLS;
+    result = 0;
     while (charCountDecoded < charCountEncoded) {
-        bytesRead = read(filein, &buffer, 1);
-        
-        if (bytesRead < 0) {
+        if (reader.count <= MAX_PACKED_CODE_LENGTH &&
+            bit_refill(&reader) == -1) {
             perror("problem reading encoded file into buffer");
-            return -1;
+            result = -1;
+            break;
+        }
+        if (outCount > outLimit) {
+            out->count = outCount;
+            if (buf_flush(out) == -1) {
+                perror("write");
+                result = -1;
+                break;
+            }
+            outData = out->data; /* a writer thread hands out another */
+            outCount = 0;
+        }
+        entry = &table->entries[reader.buffer >> (64 - DECODE_TABLE_BITS)];
+        if (entry->count > 0) {
+            for (i = 0; i < entry->count; i++) {
+                outData[outCount++] = entry->symbols[i];
+            }
+            charCountDecoded += entry->count;
+            if (charCountDecoded >= charCountEncoded) {
+                /* last lookup may run into padding, drop extra characters */
+                outCount -= charCountDecoded - charCountEncoded;
+                charCountDecoded = charCountEncoded;
+                break;
+            }
+            if (entry->bits > reader.count) {
+                fprintf(stderr, "encoded file is truncated\n");
+                result = -1;
+                break;
+            }
+            reader.buffer <<= entry->bits;
+            reader.count -= entry->bits;
+            continue;
+        }
+        /* long code: resume from the node the table bits led to */
+        if ((symbol = decode_long_code(table, entry, &reader)) == -1) {
+            fprintf(stderr, "encoded file is corrupt or truncated\n");
+            result = -1;
+            break;
+        }
+        outData[outCount++] = symbol;
+        charCountDecoded++;
+    }
+    out->count = outCount; /* caller flushes what is left */
+    return result;
+}
+
+/* decode the interleaved streams of a body held in memory into the
+   charCount bytes at dst. Stream k holds the k-th of streamCount equal
+   runs of characters and starts right after stream k - 1; one pass of
+   the main loop takes a table hit from every stream, so their lookups
+   overlap instead of each waiting on the last code's length */
+int decode_streams(const DecodeTable* table, int streamCount,
+                    const unsigned char* body, const uint64_t streamLengths[],
+                    uint64_t charCount, unsigned char* dst) {
+    BufReader sources[MAX_STREAMS];
+    BitReader readers[MAX_STREAMS];
+    uint64_t next[MAX_STREAMS], stop[MAX_STREAMS], run;
+    const DecodeEntry *entry;
+    int k, i, symbol;
+
+    run = charCount / streamCount + (charCount % streamCount != 0);
+    for (k = 0; k < streamCount; k++) {
+        sources[k].file = -1;
+        sources[k].data = (unsigned char*)body;
+        sources[k].size = streamLengths[k];
+        sources[k].next = 0;
+        sources[k].end = streamLengths[k];
+        sources[k].offset = 0;
+        sources[k].eof = 1;
+        sources[k].borrowed = 1;
+        sources[k].mapped = 0;
+        sources[k].ring = NULL;
+        readers[k].buffer = 0;
+        readers[k].count = 0;
+        readers[k].source = &sources[k];
+        readers[k].limit = streamLengths[k];
+        body += streamLengths[k];
+        next[k] = (uint64_t)run * k < charCount ? run * k : charCount;
+        stop[k] = charCount - next[k] > run ? next[k] + run : charCount;
+    }
+
+    /* all streams together while each has more characters left than one
+       lookup can resolve, so no lookup reaches into padding */
+    for (;;) {
+        for (k = 0; k < streamCount; k++) {
+            if (stop[k] - next[k] <= DECODE_MAX_SYMBOLS) {
+                break;
+            }
+            if (readers[k].count <= MAX_PACKED_CODE_LENGTH) {
+                bit_refill(&readers[k]);
+            }
         }
-        if (bytesRead > 0) {
-            char_to_8_bit_string(buffer, eightBitString);
+        if (k < streamCount) {
+            break;
+        }
+        for (k = 0; k < streamCount; k++) {
+            entry = &table->entries[readers[k].buffer >> 
+                                    (64 - DECODE_TABLE_BITS)];
+            if (entry->count > 0 && entry->bits <= readers[k].count) {
+                memcpy(dst + next[k], entry->symbols, DECODE_MAX_SYMBOLS);
+                next[k] += entry->count;
+                readers[k].buffer <<= entry->bits;
+                readers[k].count -= entry->bits;
+            } else if (entry->count == 0 && 
+                (symbol = decode_long_code(table, entry, &readers[k])) != -1) {
+                dst[next[k]++] = symbol;
+            } else {
+                fprintf(stderr, "encoded file is corrupt or truncated\n");
+                return -1;
+            }
+        }
+    }
 
-            for (i = 0; i < 8; i++) {
-                if (eightBitString[i] == '0') {
-                    current = current->left;
-                } else {
-                    current = current->right;
+    /* then each stream's last characters on its own */
+    for (k = 0; k < streamCount; k++) {
+        while (next[k] < stop[k]) {
+            if (readers[k].count <= MAX_PACKED_CODE_LENGTH) {
+                bit_refill(&readers[k]);
+            }
+            entry = &table->entries[readers[k].buffer >> 
+                                    (64 - DECODE_TABLE_BITS)];
+            if (entry->count > 0) {
+                for (i = 0; i < entry->count && next[k] < stop[k]; i++) {
+                    dst[next[k]++] = entry->symbols[i];
                 }
-                if (node_is_leaf(current)) {
-                    /*printf("%c", current->asciiValue);*/
-                    buffer = current->asciiValue;
-                    write(fileout, &buffer, sizeof(buffer));
-                    charCountDecoded++;
-                    if (charCountDecoded >= charCountEncoded) {
-                        return 0;
-                    }
-                    current = root;
+                if (next[k] == stop[k]) {
+                    break; /* the rest may be padding */
                 }
+                if (entry->bits > readers[k].count) {
+                    fprintf(stderr, "encoded file is truncated\n");
+                    return -1;
+                }
+                readers[k].buffer <<= entry->bits;
+                readers[k].count -= entry->bits;
+            } else if ((symbol = decode_long_code(table, entry, 
+                                                    &readers[k])) != -1) {
+                dst[next[k]++] = symbol;
+            } else {
+                fprintf(stderr, "encoded file is corrupt or truncated\n");
+                return -1;
             }
-        } else { /* corner case for single character file (bytesRead = 0)*/
-            buffer = current->asciiValue;
-            write(fileout, &buffer, sizeof(buffer));
-            charCountDecoded++;
-            if (charCountDecoded >= charCountEncoded) {
-                return 0;
-            }   
         }
-        
-    }    
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/* decode legacy body by building the lookup table from the code tree */
+int traverse_for_characters(const HuffTree* tree, uint64_t charCountEncoded,
+                            BufReader* in, BufWriter* out) {
+    HuffCode codes[ASCII_TABLE_LENGTH];
+    DecodeTable *table;
+    int result;
+
+    if (tree->root < 0) {
+        return 0;
+    }
+    /* corner case for single character file */
+    if (node_is_leaf(&tree->nodes[tree->root])) {
+        return decode_fill(tree->nodes[tree->root].asciiValue, 
+                            charCountEncoded, out);
+    }
+
+    table = malloc(sizeof(DecodeTable));
+    if (table == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (build_code_table(tree, codes) > MAX_PACKED_CODE_LENGTH || 
+        build_decode_table(codes, table) != 0) {
+        fprintf(stderr, "code tree cannot be decoded\n");
+        free(table);
+        return -1;
+    }
+    /* legacy bodies run to the end of the file */
+    result = decode_body(table, charCountEncoded, UINT64_MAX, in, out);
+    free(table);
+    return result;
+}
@@ -1,38 +1,107 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include "./bufio.h"
 
 #define ASCII_TABLE_LENGTH 256 /* used for size of arrays */
-#define MAX_CODE_LENGTH 256 /* theoretical max length of a code */
-#define BUFFER_SIZE 1024 /* file read buffer size */
+#define MAX_PACKED_CODE_LENGTH 56 /* longest code a 64-bit bit buffer holds
+                                    after a refill */
+#define DECODE_TABLE_BITS 11 /* bits peeked per decode table lookup */
+#define DECODE_MAX_SYMBOLS 4 /* most symbols resolved by one lookup */
+#define MAX_STREAMS 8 /* most interleaved streams in one block body */
+#define COUNT_LANES 4 /* interleaved sub-histograms when counting */
+#define COUNT_CHUNK (1UL << 30) /* bytes counted before lanes are summed */
+
 
+#define MAX_TREE_NODES (2 * ASCII_TABLE_LENGTH - 1) /* full code tree */
 
-/* huffman node struct type */
+/* huffman node struct type, children are indices into the tree's nodes */
 typedef struct HuffmanNode {
-    int asciiValue; /* 0-255 ascii character */
-    int frequency; /* occurrence of characters*/
-    struct HuffmanNode *left; /* children of huff nodes*/
-    struct HuffmanNode *right; 
-    struct HuffmanNode *next; /* pointers for doubly linked lists*/
-    struct HuffmanNode *prev;
+    uint64_t frequency; /* occurrence of characters*/
+    int16_t asciiValue; /* 0-255 ascii character, -1 for supernodes */
+    int16_t left; /* children of huff nodes, -1 for leaves */
+    int16_t right; 
 } HuffmanNode;
 
-bool AprecedesB(HuffmanNode* a, HuffmanNode* b);
-bool node_is_leaf(HuffmanNode* node);
-int *countOccurrences(int file, int size);
-HuffmanNode* newList();
-int list_insert(HuffmanNode** head, int ascii, int freq, 
-                    HuffmanNode* left, HuffmanNode* right);
-HuffmanNode* list_pop(HuffmanNode** head);
-int list_size(HuffmanNode* head);
-void list_print(HuffmanNode* head);
-HuffmanNode* create_hufftree(HuffmanNode** head);
-int record_code(int ascii, char** codetable, char* auxString, int n);
-int traverse_for_codes(HuffmanNode* root, 
-                        char* codetable[], char* auxString, int top);
-int traverse_free_memory(HuffmanNode* root, int depth);
-int traverse_for_characters(HuffmanNode* root, uint32_t charCountEncoded, 
-                            int filein, int fileout);
+/* code tree stored in place, so building one allocates nothing and a
+   tree can be rebuilt in the same memory for every block */
+typedef struct HuffTree {
+    HuffmanNode nodes[MAX_TREE_NODES]; /* leaves, then supernodes in
+                                          creation order */
+    int root; /* index of the root, -1 for an empty tree */
+    int leafCount; /* number of characters in the tree */
+} HuffTree;
+
+/* huffman code held as an integer, first bit in the most significant
+   position of the low "length" bits */
+typedef struct HuffCode {
+    uint64_t bits;
+    int length; /* 0 when the character does not occur */
+} HuffCode;
+
+/* 64-bit bit accumulator draining into a buffered writer */
+typedef struct BitWriter {
+    uint64_t buffer; /* pending bits, first bit in the most significant bit */
+    int count; /* number of valid bits in buffer */
+    BufWriter *sink; /* whole bytes are stored straight into its buffer */
+} BitWriter;
+
+/* one slot of the multi-bit decode table, indexed by the next
+   DECODE_TABLE_BITS bits of the stream */
+typedef struct DecodeEntry {
+    unsigned char symbols[DECODE_MAX_SYMBOLS]; /* characters resolved */
+    uint8_t count; /* number of characters resolved, 0 for long codes */
+    uint8_t bits; /* bits consumed by the resolved characters */
+    int16_t node; /* long codes: tree node holding the rest of the code,
+                     -1 when the bits match no code */
+} DecodeEntry;
+
+/* lookup tables used by the decoder */
+typedef struct DecodeTable {
+    DecodeEntry entries[1 << DECODE_TABLE_BITS];
+    /* flat tree for the bits of codes past DECODE_TABLE_BITS; children
+       > 0 are internal nodes, negative children are -(character + 1) */
+    int16_t tree[ASCII_TABLE_LENGTH][2];
+    int maxLength; /* longest code */
+} DecodeTable;
+
+/* 64-bit bit buffer fed from a buffered reader */
+typedef struct BitReader {
+    uint64_t buffer; /* pending bits, next bit in the most significant bit */
+    int count; /* number of valid bits in buffer */
+    BufReader *source;
+    uint64_t limit; /* body bytes not yet taken from source */
+} BitReader;
+
+bool node_is_leaf(const HuffmanNode* node);
+void count_bytes(uint64_t totals[], const unsigned char* data, size_t n);
+uint64_t *countOccurrences(BufReader* in, int size);
+int create_hufftree(const uint64_t histogram[], HuffTree* tree);
+int build_code_table(const HuffTree* tree, HuffCode codes[]);
+int limit_code_lengths(const uint64_t histogram[], HuffCode codes[],
+                        int maxLength);
+void bit_writer_init(BitWriter* writer, BufWriter* sink);
+int bit_write(BitWriter* writer, uint64_t bits, int length);
+int encode_buffer(const HuffCode codes[], const unsigned char* in, size_t n,
+                    BitWriter* writer);
+int bit_writer_finish(BitWriter* writer);
+void assign_canonical_codes(HuffCode codes[]);
+uint64_t encoded_body_bits(const uint64_t histogram[],
+                            const HuffCode codes[]);
+int build_decode_table(const HuffCode codes[], DecodeTable* table);
+int decode_fill(int symbol, uint64_t count, BufWriter* out);
+int decode_body(const DecodeTable* table, uint64_t charCountEncoded,
+                uint64_t bodyLength, BufReader* in, BufWriter* out);
+int decode_streams(const DecodeTable* table, int streamCount,
+                    const unsigned char* body, const uint64_t streamLengths[],
+                    uint64_t charCount, unsigned char* dst);
+int traverse_for_characters(const HuffTree* tree, uint64_t charCountEncoded,
+                            BufReader* in, BufWriter* out);
+
+#endif
@@ -0,0 +1,1109 @@
+#include "./libhuffman.h"
+#include "./parallel.h"
+#include "./functions.h"
+#include "./stats.h"
+#include "./checksum.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define BUFF_HEADER_SIZE 5 /* amount of chars per entry in legacy header */
+
+
+/* a shared code table file, parsed once and kept for the life of the
+   process, so every context naming the file uses the same copy */
+typedef struct SharedTable {
+    char *path;
+    uint32_t id; /* code_table_id of codes */
+    HuffCode codes[ASCII_TABLE_LENGTH];
+    DecodeTable table;
+    struct SharedTable *next;
+} SharedTable;
+
+struct HuffContext {
+    HuffOptions options;
+    BlockHeader *block; /* header of the block being decoded */
+    DecodeTable *table; /* lookup table of the block being decoded */
+    BlockIndex index; /* offsets of every block when options.index is set */
+    const SharedTable *shared; /* options.table once loaded, or NULL */
+    HuffStats *stats; /* record of the call being made, when
+                         options.stats is set */
+};
+
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+static SharedTable *sharedTables = NULL; /* every table loaded so far */
+
+
+/* the shared table in the file at path, read the first time it is asked
+   for; NULL with a message when it cannot be */
+static const SharedTable* load_shared_table(const char* path) {
+    SharedTable *shared;
+    BufReader *in;
+    int file, result;
+
+    pthread_mutex_lock(&sharedLock);
+    for (shared = sharedTables; shared != NULL; shared = shared->next) {
+        if (strcmp(shared->path, path) == 0) {
+            pthread_mutex_unlock(&sharedLock);
+            return shared;
+        }
+    }
+    shared = malloc(sizeof(SharedTable));
+    file = open(path, O_RDONLY);
+    if (shared == NULL || file == -1) {
+        perror(shared == NULL ? "malloc" : path);
+        free(shared);
+        pthread_mutex_unlock(&sharedLock);
+        return NULL;
+    }
+    in = buf_reader_open(file, MIN_IO_BUFFER_SIZE);
+    result = in == NULL ? -1 : read_code_table(in, shared->codes);
+    buf_reader_close(in);
+    close(file);
+    if (result == 0 && build_decode_table(shared->codes, 
+                                            &shared->table) == -1) {
+        fprintf(stderr, "corrupt code length table\n");
+        result = -1;
+    }
+    shared->path = malloc(strlen(path) + 1);
+    if (result == -1 || shared->path == NULL) {
+        fprintf(stderr, "%s: cannot load code table\n", path);
+        free(shared->path);
+        free(shared);
+        pthread_mutex_unlock(&sharedLock);
+        return NULL;
+    }
+    strcpy(shared->path, path);
+    shared->id = code_table_id(shared->codes);
+    shared->next = sharedTables;
+    sharedTables = shared;
+    pthread_mutex_unlock(&sharedLock);
+    return shared;
+}
+
+
+/* write the pre-versioning header: count of characters minus 1, then
+   each character with its 4-byte big-endian frequency */
+static int write_legacy_header(BufWriter* out, const uint64_t histogram[],
+                                uint8_t charNum) {
+    int i;
+    uint8_t headerC; /* 1 byte for each unique character in header file */
+    uint32_t headerCcount; /* 4 bytes to hold each character's frequency */
+    if (buf_write(out, &charNum, sizeof(charNum)) == -1) {
+        return -1;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (histogram[i] != 0){
+            headerC = i;
+            headerCcount = htonl(histogram[i]);
+            if (buf_write(out, &headerC, sizeof(headerC)) == -1 ||
+                buf_write(out, &headerCcount, sizeof(headerCcount)) == -1) {
+                return -1;
+            }
+        }
+    }    
+    return 0;
+}
+
+
+/* code a whole file held in memory as one block, which may be stored or
+   run-length coded like any other */
+static int encode_held_file(const unsigned char* data, size_t n, 
+                            BufWriter* out, int maxLength, int codec,
+                            bool checksum, BlockIndex* index) {
+    uint64_t codedOffset = buf_position(out), bodyBits;
+    if (encode_block(data, n, maxLength, 1, codec, NULL, checksum, out, 
+                        &bodyBits) == -1) {
+        return -1;
+    }
+    if (index != NULL && index_add(index, codedOffset, 0, bodyBits) == -1) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+/* two passes over a seekable file: histogram first, then a single block
+   (or the legacy body) coded on the re-read; a file that is in memory
+   already is coded in one go */
+static int encode_whole_file(BufReader* in, BufWriter* out, bool legacy,
+                                int maxLength, int codec, bool checksum, 
+                                BlockIndex* index) {
+    int i, codeLength;
+    uint64_t *histogram; /* pointer array to hold histogram of occurences */
+    HuffTree tree; /* code tree */
+    HuffCode codeTable[ASCII_TABLE_LENGTH]; /* translation table */
+    BitWriter writer; /* bit accumulator for the body */
+    BlockHeader block; /* header of the single huffman block */
+    ssize_t bytesRead;
+    uint8_t charNum; /* number of unique characters minus 1*/
+    double clock;
+    size_t codedSize;
+    bool store = false; /* body written as it is */
+    uint32_t crc = 0; /* checksum of the characters */
+    int result = -1;
+
+    if (!legacy && in->borrowed) {
+        return encode_held_file(in->data, in->end, out, maxLength, codec,
+                                checksum, index);
+    }
+    /* building histogram of character occurrences */
+    histogram = countOccurrences(in, ASCII_TABLE_LENGTH);
+    if (histogram == NULL) {
+        perror("histogram");
+        return -1;
+    }
+    if (!legacy && in->offset == 0) { /* it all fit in the read buffer */
+        result = encode_held_file(in->data, in->end, out, maxLength, codec,
+                                    checksum, index);
+        goto done;
+    }
+
+    /* writing header */
+    clock = stats_clock();
+    if (legacy) {
+        for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+            if (histogram[i] > UINT32_MAX) {
+                fprintf(stderr, "hencode: legacy headers count each "
+                        "character in 32 bits\n");
+                goto done;
+            }
+        }
+        if (create_hufftree(histogram, &tree) != 0) { /* creating tree */
+            perror("tree creation");
+            goto done;
+        }
+        charNum = tree.leafCount - 1; /* to be used for header */
+        /* traversing tree to write codes in codeTable */
+        codeLength = build_code_table(&tree, codeTable);
+        /* legacy decoders rebuild the tree, so its codes cannot change */
+        if (codeLength > maxLength) {
+            fprintf(stderr, "hencode: code longer than %d bits\n", 
+                    maxLength);
+            goto done;
+        }
+        stats_coded(histogram, codeLength, 
+                    encoded_body_bits(histogram, codeTable));
+        if (write_legacy_header(out, histogram, charNum) == -1) {
+            perror("header write");
+            goto done;
+        }
+    } else {
+        if (plan_block(histogram, maxLength, &block) == -1) {
+            goto done;
+        }
+        stats_coded(histogram, block.maxLength, block.bodyBits);
+        memcpy(codeTable, block.codes, sizeof(codeTable));
+        stats_phase(STAT_TREE, clock);
+        /* input that does not get smaller coded is stored as it is */
+        codedSize = block_header_size(&block) + block.bodyLength;
+        block.type = BLOCK_STORED;
+        store = block.loneSymbol == -1 && 
+                block_header_size(&block) + block.charCount < codedSize;
+        if (store) {
+            block.bodyLength = block.charCount;
+            block.bodyBits = (uint64_t)block.charCount * 8;
+        } else {
+            block.type = BLOCK_HUFFMAN;
+        }
+        if (index != NULL && 
+            index_add(index, buf_position(out), 0, block.bodyBits) == -1) {
+            perror("malloc");
+            goto done;
+        }
+        if (write_block_header(out, FORMAT_VERSION, &block) == -1) {
+            perror("header write");
+            goto done;
+        }
+    }
+    if (legacy) {
+        stats_phase(STAT_TREE, clock);
+    }
+
+    /* seek beginning of file for re-read */
+    if (buf_rewind(in) == -1) {
+        perror("lseek");
+        goto done;
+    }
+
+    /* writing body */
+    bit_writer_init(&writer, out);
+    while (( bytesRead = buf_fill(in) ) != 0) {
+        if (bytesRead == -1) {
+            perror("read buffer");
+            goto done;
+        }
+        clock = stats_clock();
+        if ((store ? buf_write(out, in->data + in->next, bytesRead) :
+            encode_buffer(codeTable, in->data + in->next, bytesRead, 
+                            &writer)) == -1) {
+            perror("write body");
+            goto done;
+        }
+        stats_phase(STAT_ENCODE, clock);
+        if (checksum) {
+            clock = stats_clock();
+            crc = crc32c(crc, in->data + in->next, bytesRead);
+            stats_phase(STAT_CHECKSUM, clock);
+        }
+        in->next = in->end;
+    }
+    /* last byte padded with 0s */
+    if (bit_writer_finish(&writer) == -1) {
+        perror("write padding");
+        goto done;
+    }
+    if (checksum && write_block_checksum(out, crc) == -1) {
+        perror("write checksum");
+        goto done;
+    }
+
+    result = 0;
+done:
+    free(histogram);
+    return result;
+}
+
+/* up to n bytes of input, viewed in place when the input is mapped and
+   copied into buffer otherwise */
+static ssize_t next_block(BufReader* in, unsigned char* buffer, 
+                            const unsigned char** data, size_t n) {
+    if (buffer == NULL) {
+        return buf_view(in, data, n);
+    }
+    *data = buffer;
+    return buf_read(in, buffer, n);
+}
+
+/* single pass in blocks of blockSize bytes, each with its own codes,
+   written as soon as it is coded; works on pipes */
+static int encode_stream(BufReader* in, BufWriter* out, size_t blockSize,
+                            int maxLength, int streams, int codec,
+                            const HuffCode shared[], bool checksum,
+                            BlockIndex* index) {
+    unsigned char *buffer; /* copy of the block, unless input is mapped */
+    const unsigned char *data;
+    ssize_t bytesRead;
+    uint64_t codedOffset, decodedOffset, bodyBits;
+    int result = 0;
+    buffer = NULL;
+    if (!in->borrowed && (buffer = malloc(blockSize)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    decodedOffset = 0;
+    while (result == 0 && 
+            (bytesRead = next_block(in, buffer, &data, blockSize)) > 0) {
+        codedOffset = buf_position(out);
+        result = encode_block(data, bytesRead, maxLength, streams, codec,
+                                shared, checksum, out, &bodyBits);
+        if (result == 0 && index != NULL && 
+            index_add(index, codedOffset, decodedOffset, bodyBits) == -1) {
+            perror("malloc");
+            result = -1;
+        }
+        decodedOffset += bytesRead;
+    }
+    if (bytesRead == -1) {
+        perror("read");
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+
+/* code everything in from after the empty file check: the legacy
+   format, or the file header, the blocks the options ask for, the end
+   block and the index */
+static int encode_all(HuffContext* context, BufReader* in, BufWriter* out) {
+    const HuffOptions *options = &context->options;
+    const HuffCode *shared = NULL;
+    BlockIndex *index = NULL;
+    uint32_t tableId = 0;
+    int result, flags = 0;
+
+    if (options->legacy) {
+        return encode_whole_file(in, out, true, options->maxLength, 
+                                    HUFF_CODEC_HUFFMAN, false, NULL);
+    }
+    if (options->index) {
+        index = &context->index;
+        index->count = 0; /* keeps its memory from earlier calls */
+        flags |= FLAG_INDEX;
+    }
+    if (context->shared != NULL) {
+        shared = context->shared->codes;
+        tableId = context->shared->id;
+        flags |= FLAG_TABLE;
+    }
+    if (options->checksum) {
+        flags |= FLAG_CHECKSUM;
+    }
+    if (write_file_header(out, flags, tableId) == -1) {
+        perror("header write");
+        return -1;
+    }
+    if (options->threads > 1) {
+        result = encode_parallel(in, out, options->blockSize, 
+                                    options->maxLength, options->streams,
+                                    options->codec, shared, 
+                                    options->checksum, options->threads, 
+                                    options->inFlight, index);
+    } else if (options->blockSize > 0 || 
+                (options->codec != HUFF_CODEC_HUFFMAN && !in->borrowed)) {
+        /* tANS codes a block backwards from memory, so a whole file that
+           is not held there is taken in blocks instead of twice over */
+        result = encode_stream(in, out, options->blockSize > 0 ? 
+                                options->blockSize : DEFAULT_BLOCK_SIZE, 
+                                options->maxLength, options->streams, 
+                                options->codec, shared, options->checksum, 
+                                index);
+    } else {
+        result = encode_whole_file(in, out, false, options->maxLength, 
+                                    options->codec, options->checksum, 
+                                    index);
+    }
+    if (result == 0 && (write_end_block(out) == -1 || 
+        (index != NULL && write_index(out, index) == -1))) {
+        perror("write");
+        result = -1;
+    }
+    return result;
+}
+
+/* decode a file in the pre-versioning format, rebuilding the code tree
+   from the character frequencies in its header */
+static int decode_legacy(BufReader* in, BufWriter* out) {
+    int i;
+    uint64_t charCountEncoded;
+    ssize_t bytesRead;
+    unsigned char buffer[BUFF_HEADER_SIZE];
+    int tableLength; /* number of unique chars */
+    uint64_t *histogram; /* pointer to array to hold histogram of occurrences*/
+    HuffTree tree; /* code tree */
+    double clock;
+    int result = -1;
+
+    /* reading header to build frequency table */
+    if ((bytesRead = buf_read(in, buffer, 1)) != 1) {
+        perror("header read");
+        return -1;
+    }
+    tableLength = (int)buffer[0] + 1; /* add 1 because of num -1 format*/
+
+    histogram = malloc(sizeof(uint64_t) * ASCII_TABLE_LENGTH);
+    if (histogram == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        histogram[i] = 0;
+    }
+
+    charCountEncoded = 0;
+    for (i = 0; i< tableLength; i++) {
+        /* 1 byte for c; 4 bytes for count of c */
+        bytesRead = buf_read(in, buffer, BUFF_HEADER_SIZE); 
+        if (bytesRead != BUFF_HEADER_SIZE) {
+            perror("buffer read");
+            goto done;
+        }
+        /* converting 4 chars to uint32 reverting significance order*/
+        /* shift last char byte 3 times to left, 3rd byte two times, and so on*/
+        /* add them all up using logical or. Result will be the value to store 
+                                            in occurence table*/
+        histogram[(int) buffer[0]] = ((uint32_t)buffer[1] << 24) |
+                    (buffer[2] << 16) | (buffer[3] << 8) | buffer[4];
+        /*   AA       BB       CC       DD
+        * AA=00000000 00000000 00000000 aaaaaaaa  (buffer[1])
+        * BB=00000000 00000000 00000000 bbbbbbbb  (buffer[2])
+        * CC=00000000 00000000 00000000 cccccccc  (buffer[3])
+        * DD=00000000 00000000 00000000 dddddddd  (buffer[4])
+        * (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]
+
+        * aaaaaaaa 00000000 00000000 00000000 <= 3 bytes (24) shift
+        * 00000000 bbbbbbbb 00000000 00000000 <= 2 bytes (16) shift
+        * 00000000 00000000 cccccccc 00000000 <= 1 byte (8) shift
+        * 00000000 00000000 00000000 dddddddd <= no shift
+        * ---------- OR sum -----------------
+        * aaaaaaaa bbbbbbbb cccccccc dddddddd */
+
+        /* to know how many characters to decode later */
+        charCountEncoded += histogram[(int) buffer[0]]; 
+    }
+
+    /* build code tree */
+    clock = stats_clock();
+    if (create_hufftree(histogram, &tree) != 0) {
+        perror("tree creation");
+        goto done;
+    }
+    stats_phase(STAT_TREE, clock);
+    
+    clock = stats_clock();
+    if (traverse_for_characters(&tree, charCountEncoded, in, out) == -1) {
+        fprintf(stderr, "traversing tree for characters failed\n");
+        goto done;
+    }
+    stats_phase(STAT_DECODE, clock);
+
+    result = 0;
+done:
+    free(histogram);
+    return result;
+}
+
+/* add up the characters of the blocks from here to the end block of a
+   file of this version and flags, skipping their bodies; block is
+   scratch space */
+static int sum_block_sizes(BufReader* in, int version, int flags,
+                            BlockHeader* block, uint64_t* size) {
+    *size = 0;
+    for (;;) {
+        if (read_block_header(in, version, block) == -1) {
+            return -1;
+        }
+        if (block->type == BLOCK_END) {
+            return 0;
+        }
+        if (buf_skip(in, block->bodyLength + (flags & FLAG_CHECKSUM ?
+                        BLOCK_CHECKSUM_SIZE : 0)) == -1) {
+            fprintf(stderr, "truncated block body\n");
+            return -1;
+        }
+        *size += block->charCount;
+    }
+}
+
+/* with HUFF_IO_MAP, decode straight into a mapping of the output file
+   when the input is in memory, so the block headers can be read ahead
+   to learn the output size; the room past it is for the characters
+   decode_body may store beyond the last one. Outputs that cannot be
+   mapped are written as usual */
+static int map_output(HuffContext* context, BufReader* in, BufWriter* out, 
+                        int version, int flags) {
+    uint64_t size;
+    size_t start = in->next;
+    if (context->options.io != HUFF_IO_MAP || !in->borrowed || 
+        out->file == -1 || out->borrowed) {
+        return 0;
+    }
+    if (sum_block_sizes(in, version, flags, context->block, &size) == -1) {
+        return -1;
+    }
+    in->next = start;
+    buf_writer_map(out, size + DECODE_MAX_SYMBOLS);
+    return 0;
+}
+
+/* decode a versioned file block by block; shared is the lookup table of
+   the file's shared table, or NULL, and checksum says whether blocks
+   end in a checksum */
+static int decode_blocks(HuffContext* context, int version,
+                            const DecodeTable* shared, bool checksum,
+                            BufReader* in, BufWriter* out) {
+    BlockHeader *block = context->block;
+    int result = 0;
+    while (result == 0) {
+        if (read_block_header(in, version, block) == -1) {
+            result = -1;
+            break;
+        }
+        if (block->type == BLOCK_END) {
+            break;
+        }
+        result = decode_block(block, context->table, shared, checksum, 
+                                in, out);
+    }
+    return result;
+}
+
+/* decode only the characters from offset to offset + length of a
+   versioned file; with a block index on a seekable file it jumps to the
+   first block needed, otherwise it reads block headers and skips the
+   bodies before the range. Either way it stops after the range */
+static int decode_range(HuffContext* context, int version,
+                        const DecodeTable* shared, BufReader* in,
+                        BufWriter* out, int flags, uint64_t offset,
+                        uint64_t length) {
+    BlockIndex index;
+    BlockHeader *block = context->block;
+    uint64_t blockStart, blockEnd, end;
+    off_t start;
+    size_t first;
+    int result = 0;
+    bool checksum = flags & FLAG_CHECKSUM;
+
+    end = offset + length;
+    blockStart = 0;
+    if (flags & FLAG_INDEX) {
+        start = in->offset + in->next;
+        switch (read_index(in, &index)) {
+            case -1:
+                return -1;
+            case 0: /* jump to the block holding offset */
+                if (index.count == 0) {
+                    free_index(&index);
+                    return 0;
+                }
+                first = index_find(&index, offset);
+                start = index.entries[first].codedOffset;
+                blockStart = index.entries[first].decodedOffset;
+                free_index(&index);
+                break;
+            default: /* no usable index, walk from the first block */
+                break;
+        }
+        if (buf_seek(in, start) == -1) {
+            perror("lseek");
+            return -1;
+        }
+    }
+
+    while (result == 0 && blockStart < end) {
+        if (read_block_header(in, version, block) == -1) {
+            result = -1;
+            break;
+        }
+        if (block->type == BLOCK_END) {
+            break;
+        }
+        blockEnd = blockStart + block->charCount;
+        if (blockEnd <= offset) { /* wholly before the range */
+            if (buf_skip(in, block->bodyLength + 
+                            (checksum ? BLOCK_CHECKSUM_SIZE : 0)) == -1) {
+                fprintf(stderr, "truncated block body\n");
+                result = -1;
+            }
+            blockStart = blockEnd;
+            continue;
+        }
+        /* decode up to the end of the range, dropping what precedes it */
+        if (blockEnd > end) {
+            block->keepCount = end - blockStart;
+        }
+        if (offset > blockStart) {
+            out->discard = offset - blockStart;
+        }
+        result = decode_block(block, context->table, shared, checksum, 
+                                in, out);
+        blockStart = blockEnd;
+    }
+    return result;
+}
+
+/* decode everything in from after the empty file check, or only the
+   characters from offset to offset + length when ranged */
+static int decode_all(HuffContext* context, BufReader* in, BufWriter* out,
+                        bool ranged, uint64_t offset, uint64_t length) {
+    const DecodeTable *shared = NULL;
+    int version, flags;
+    uint32_t tableId;
+    version = read_file_header(in, &flags, &tableId);
+    if (version == -1) {
+        return -1;
+    }
+    if (flags & FLAG_TABLE) {
+        if (context->shared == NULL) {
+            fprintf(stderr, "file is coded with shared table %08lx, which "
+                    "is needed to decode it\n", (unsigned long)tableId);
+            return -1;
+        }
+        if (context->shared->id != tableId) {
+            fprintf(stderr, "file is coded with shared table %08lx, not "
+                    "%08lx\n", (unsigned long)tableId, 
+                    (unsigned long)context->shared->id);
+            return -1;
+        }
+        shared = &context->shared->table;
+    }
+    if (version == FORMAT_LEGACY) {
+        if (ranged) {
+            fprintf(stderr, "legacy files cannot be decoded in part\n");
+            return -1;
+        }
+        /* legacy bodies are decoded with a few bytes of lookahead in the
+           output, which a caller's buffer does not have */
+        if (out->borrowed) {
+            fprintf(stderr, "legacy files can only be decoded from a "
+                    "file\n");
+            return -1;
+        }
+        return decode_legacy(in, out);
+    }
+    if (ranged) {
+        return decode_range(context, version, shared, in, out, flags,
+                            offset, length);
+    }
+    if (map_output(context, in, out, version, flags) == -1) {
+        return -1;
+    }
+    if (context->options.threads > 1) {
+        return decode_parallel(in, out, version, shared,
+                                flags & FLAG_CHECKSUM,
+                                context->options.threads, 
+                                context->options.inFlight);
+    }
+    return decode_blocks(context, version, shared, flags & FLAG_CHECKSUM,
+                            in, out);
+}
+
+/* options with the defaults of hencode and hdecode */
+void huff_default_options(HuffOptions* options) {
+    const char *stats;
+    options->legacy = false;
+    options->maxLength = MAX_PACKED_CODE_LENGTH;
+    options->blockSize = 0;
+    options->streams = 1;
+    options->codec = HUFF_CODEC_HUFFMAN;
+    options->threads = 1;
+    options->inFlight = 0;
+    options->index = false;
+    options->checksum = false;
+    options->bufferSize = DEFAULT_IO_BUFFER_SIZE;
+    options->io = HUFF_IO_SYNC;
+    options->ioDepth = DEFAULT_IO_DEPTH;
+    options->table = NULL;
+    stats = getenv("HUFF_STATS");
+    options->stats = stats != NULL && *stats != '\0' && 
+                        strcmp(stats, "0") != 0;
+}
+
+/* check options and fill in what they leave to the library, -1 with a
+   message when they cannot be used together */
+static int settle_options(HuffOptions* options) {
+    if (options->maxLength < 1 || 
+        options->maxLength > MAX_PACKED_CODE_LENGTH ||
+        options->streams < 1 || options->streams > MAX_STREAMS ||
+        options->codec < HUFF_CODEC_HUFFMAN || 
+        options->codec > HUFF_CODEC_PAIRS ||
+        options->threads < 1 || options->threads > MAX_THREADS ||
+        options->inFlight < 0 || 
+        options->bufferSize < MIN_IO_BUFFER_SIZE ||
+        options->io < HUFF_IO_SYNC || options->io > HUFF_IO_MAP ||
+        options->ioDepth < 2 || options->ioDepth > MAX_IO_DEPTH) {
+        fprintf(stderr, "option out of range\n");
+        return -1;
+    }
+    if (options->legacy && options->streams > 1) {
+        fprintf(stderr, "legacy format has one stream\n");
+        return -1;
+    }
+    if (options->table != NULL && (options->legacy || options->streams > 1)) {
+        fprintf(stderr, "shared tables code one stream in the versioned "
+                "format\n");
+        return -1;
+    }
+    if (options->codec == HUFF_CODEC_ANS && 
+        (options->streams > 1 || options->table != NULL)) {
+        fprintf(stderr, "tANS blocks have one stream and codes of their "
+                "own\n");
+        return -1;
+    }
+    if (options->codec == HUFF_CODEC_PAIRS && 
+        (options->streams > 1 || options->table != NULL)) {
+        fprintf(stderr, "pair blocks have one stream and codes of their "
+                "own\n");
+        return -1;
+    }
+    if (options->legacy && options->codec != HUFF_CODEC_HUFFMAN) {
+        fprintf(stderr, "legacy format has huffman codes only\n");
+        return -1;
+    }
+    /* parallel coding needs blocks, and so do streams, which the decoder
+       holds a whole block of at a time, and shared tables, which skip the
+       histogram pass over a whole file */
+    if ((options->threads > 1 || options->streams > 1 || 
+        options->table != NULL) && options->blockSize == 0) {
+        options->blockSize = DEFAULT_BLOCK_SIZE;
+    }
+    if (options->inFlight == 0) {
+        options->inFlight = 2 * options->threads;
+    }
+    if (options->legacy && options->blockSize > 0) {
+        fprintf(stderr, "legacy format cannot be streamed\n");
+        return -1;
+    }
+    if (options->legacy && options->index) {
+        fprintf(stderr, "legacy format has no block index\n");
+        return -1;
+    }
+    if (options->legacy && options->checksum) {
+        fprintf(stderr, "legacy format has no checksums\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* new context for options, or the defaults when NULL; NULL on error */
+HuffContext* huff_context_new(const HuffOptions* options) {
+    HuffContext *context = malloc(sizeof(HuffContext));
+    if (context == NULL) {
+        return NULL;
+    }
+    if (options != NULL) {
+        context->options = *options;
+    } else {
+        huff_default_options(&context->options);
+    }
+    context->block = malloc(sizeof(BlockHeader));
+    context->table = malloc(sizeof(DecodeTable));
+    index_init(&context->index);
+    context->shared = NULL;
+    context->stats = context->options.stats ? stats_new() : NULL;
+    if (context->block == NULL || context->table == NULL ||
+        (context->options.stats && context->stats == NULL)) {
+        huff_context_free(context);
+        return NULL;
+    }
+    if (settle_options(&context->options) == -1 ||
+        (context->options.table != NULL && 
+        (context->shared = load_shared_table(context->options.table)) == 
+            NULL)) {
+        huff_context_free(context);
+        errno = EINVAL;
+        return NULL;
+    }
+    return context;
+}
+
+void huff_context_free(HuffContext* context) {
+    if (context != NULL) {
+        free(context->block);
+        free(context->table);
+        free_index(&context->index);
+        stats_free(context->stats);
+        free(context);
+    }
+}
+
+/* most bytes huff_compress can turn n bytes into with these options */
+size_t huff_compress_bound(const HuffContext* context, size_t n) {
+    const HuffOptions *options = &context->options;
+    size_t blocks, bound;
+    if (options->legacy) {
+        /* count byte, every 5-byte entry and the padded last byte, then
+           the room the bit writer keeps for its 8-byte stores */
+        return n + 1 + ASCII_TABLE_LENGTH * BUFF_HEADER_SIZE + 1 +
+                2 * IO_BUFFER_SLACK;
+    }
+    blocks = 0;
+    if (n > 0) {
+        blocks = options->blockSize == 0 ? 1 :
+                    n / options->blockSize + (n % options->blockSize != 0);
+    }
+    bound = n + FORMAT_MAGIC_LENGTH + 2 + blocks * encoded_block_bound(0) +
+            1 + IO_BUFFER_SLACK;
+    if (options->index) {
+        bound += blocks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    }
+    if (options->table != NULL) {
+        bound += TABLE_ID_SIZE;
+    }
+    return bound;
+}
+
+/* code n bytes at src into at most capacity bytes at dst, which
+   huff_compress_bound bytes are always enough for; *written receives
+   the coded size. Returns -1 on error, with errno ENOSPC when dst is
+   too small */
+int huff_compress(HuffContext* context, const void* src, size_t n,
+                    void* dst, size_t capacity, size_t* written) {
+    BufReader *in;
+    BufWriter *out;
+    int result;
+    bool stats;
+    *written = 0;
+    if (n == 0) { /* like an empty file, nothing at all */
+        return 0;
+    }
+    if (capacity < IO_BUFFER_SLACK) {
+        errno = ENOSPC;
+        return -1;
+    }
+    /* the bit writers' 8-byte stores need the slack inside dst */
+    in = buf_reader_wrap(src, n);
+    out = buf_writer_wrap(dst, capacity - IO_BUFFER_SLACK);
+    if (in == NULL || out == NULL) {
+        perror("malloc");
+        buf_reader_close(in);
+        buf_writer_close(out);
+        return -1;
+    }
+    stats = context->stats != NULL && stats_begin(context->stats);
+    result = encode_all(context, in, out);
+    *written = out->count;
+    if (stats) {
+        stats_bytes(n, *written);
+        stats_end(context->stats, "compress");
+    }
+    if (result == -1 && out->full) {
+        errno = ENOSPC; /* messages printed since may have changed it */
+    }
+    buf_writer_close(out);
+    buf_reader_close(in);
+    return result;
+}
+
+/* number of bytes the n coded bytes at src decode to, read from the
+   block headers without decoding anything */
+int huff_decompressed_size(const void* src, size_t n, uint64_t* size) {
+    BufReader *in;
+    BlockHeader *block;
+    int flags, version, result = 0;
+    uint32_t tableId;
+    *size = 0;
+    if (n == 0) {
+        return 0;
+    }
+    in = buf_reader_wrap(src, n);
+    block = malloc(sizeof(BlockHeader));
+    if (in == NULL || block == NULL) {
+        perror("malloc");
+        buf_reader_close(in);
+        free(block);
+        return -1;
+    }
+    version = read_file_header(in, &flags, &tableId);
+    if (version == FORMAT_LEGACY) {
+        fprintf(stderr, "legacy files can only be decoded from a file\n");
+        result = -1;
+    } else if (version == -1) {
+        result = -1;
+    } else {
+        result = sum_block_sizes(in, version, flags, block, size);
+    }
+    free(block);
+    buf_reader_close(in);
+    return result;
+}
+
+/* decode the n bytes at src into at most capacity bytes at dst, which
+   need be no more than huff_decompressed_size; *written receives the
+   decoded size. Returns -1 on error, with errno ENOSPC when dst is too
+   small */
+int huff_decompress(HuffContext* context, const void* src, size_t n,
+                    void* dst, size_t capacity, size_t* written) {
+    BufReader *in;
+    BufWriter *out;
+    int result;
+    bool stats;
+    *written = 0;
+    if (n == 0) {
+        return 0;
+    }
+    in = buf_reader_wrap(src, n);
+    out = buf_writer_wrap(dst, capacity);
+    if (in == NULL || out == NULL) {
+        perror("malloc");
+        buf_reader_close(in);
+        buf_writer_close(out);
+        return -1;
+    }
+    stats = context->stats != NULL && stats_begin(context->stats);
+    result = decode_all(context, in, out, false, 0, 0);
+    *written = out->count;
+    if (stats) {
+        stats_bytes(n, *written);
+        stats_end(context->stats, "decompress");
+    }
+    if (result == -1 && out->full) {
+        errno = ENOSPC;
+    }
+    buf_writer_close(out);
+    buf_reader_close(in);
+    return result;
+}
+
+/* hand the reads and writes of files to threads when the options ask */
+static int start_io(const HuffOptions* options, BufReader* reader, 
+                    BufWriter* writer) {
+    if (options->io == HUFF_IO_THREAD &&
+        (buf_reader_async(reader, options->ioDepth) == -1 ||
+        buf_writer_async(writer, options->ioDepth) == -1)) {
+        perror("I/O thread");
+        return -1;
+    }
+    return 0;
+}
+
+static int encode_file(HuffContext* context, int in, int out) {
+    BufReader *reader;
+    BufWriter *writer;
+    int result;
+    reader = buf_reader_map(in, context->options.bufferSize);
+    if (reader == NULL) {
+        reader = buf_reader_open(in, context->options.bufferSize);
+    }
+    writer = buf_writer_open(out, context->options.bufferSize);
+    if (reader == NULL || writer == NULL) {
+        perror("malloc");
+        buf_reader_close(reader);
+        buf_writer_close(writer);
+        return -1;
+    }
+    if (start_io(&context->options, reader, writer) == -1) {
+        buf_reader_close(reader);
+        buf_writer_close(writer);
+        return -1;
+    }
+    if (reader->mapped) {
+        stats_bytes(reader->end, 0);
+    }
+    result = file_is_empty(reader);
+    if (result == 1) {
+        result = encode_all(context, reader, writer);
+    }
+    if (buf_writer_close(writer) == -1) {
+        perror("write");
+        result = -1;
+    }
+    buf_reader_close(reader);
+    return result;
+}
+
+/* decode file in into file out, or with out -1 into a writer that drops
+   everything */
+static int decode_file(HuffContext* context, int in, int out, bool ranged,
+                        uint64_t offset, uint64_t length) {
+    BufReader *reader;
+    BufWriter *writer;
+    int result;
+    reader = buf_reader_map(in, context->options.bufferSize);
+    if (reader == NULL) {
+        reader = buf_reader_open(in, context->options.bufferSize);
+    }
+    writer = buf_writer_open(out, context->options.bufferSize);
+    if (reader == NULL || writer == NULL) {
+        perror("malloc");
+        buf_reader_close(reader);
+        buf_writer_close(writer);
+        return -1;
+    }
+    if (start_io(&context->options, reader, writer) == -1) {
+        buf_reader_close(reader);
+        buf_writer_close(writer);
+        return -1;
+    }
+    if (out == -1) {
+        writer->discard = UINT64_MAX;
+    }
+    if (reader->mapped) {
+        stats_bytes(reader->end, 0);
+    }
+    result = file_is_empty(reader);
+    if (result == 1) {
+        result = decode_all(context, reader, writer, ranged, offset, length);
+    }
+    if (buf_writer_close(writer) == -1) {
+        perror("write");
+        result = -1;
+    }
+    buf_reader_close(reader);
+    return result;
+}
+
+/* code file in into file out, both left open; large regular files are
+   mapped, anything else is read */
+int huff_encode_file(HuffContext* context, int in, int out) {
+    bool stats = context->stats != NULL && stats_begin(context->stats);
+    int result = encode_file(context, in, out);
+    if (stats) {
+        stats_end(context->stats, "encode_file");
+    }
+    return result;
+}
+
+/* decode file in into file out, both left open; with HUFF_IO_MAP an
+   empty regular out opened for reading and writing is mapped and decoded
+   into in place when in is mapped too */
+int huff_decode_file(HuffContext* context, int in, int out) {
+    bool stats = context->stats != NULL && stats_begin(context->stats);
+    int result = decode_file(context, in, out, false, 0, 0);
+    if (stats) {
+        stats_end(context->stats, "decode_file");
+    }
+    return result;
+}
+
+/* decode only the characters from offset to offset + length of file in
+   into file out; with a block index on a seekable file only the blocks
+   holding them are read */
+int huff_decode_file_range(HuffContext* context, int in, int out,
+                            uint64_t offset, uint64_t length) {
+    bool stats = context->stats != NULL && stats_begin(context->stats);
+    int result = decode_file(context, in, out, true, offset, length);
+    if (stats) {
+        stats_end(context->stats, "decode_range");
+    }
+    return result;
+}
+
+/* decode file in without writing anything, checking the checksums of
+   files that have them; 0 when the whole file decodes */
+int huff_test_file(HuffContext* context, int in) {
+    bool stats = context->stats != NULL && stats_begin(context->stats);
+    int result = decode_file(context, in, -1, false, 0, 0);
+    if (stats) {
+        stats_end(context->stats, "test_file");
+    }
+    return result;
+}
+
+/* build a shared table from the inCount sample files in and write it to
+   file out. Every character gets a code, the ones the samples lack the
+   longest, so any input can be coded with the table */
+int huff_train_table(const int in[], int inCount, int out, int maxLength) {
+    uint64_t totals[ASCII_TABLE_LENGTH];
+    BlockHeader *block;
+    BufReader *reader;
+    BufWriter *writer;
+    ssize_t bytesRead = 0;
+    int i, result;
+
+    memset(totals, 0, sizeof(totals));
+    for (i = 0; i < inCount && bytesRead != -1; i++) {
+        reader = buf_reader_open(in[i], DEFAULT_IO_BUFFER_SIZE);
+        if (reader == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        while ((bytesRead = buf_fill(reader)) > 0) {
+            count_bytes(totals, reader->data + reader->next, bytesRead);
+            reader->next = reader->end;
+        }
+        buf_reader_close(reader);
+    }
+    if (bytesRead == -1) {
+        perror("read");
+        return -1;
+    }
+    /* every character gets a code, for inputs unlike the samples */
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        totals[i]++;
+    }
+
+    block = malloc(sizeof(BlockHeader));
+    writer = buf_writer_open(out, DEFAULT_IO_BUFFER_SIZE);
+    if (block == NULL || writer == NULL) {
+        perror("malloc");
+        free(block);
+        buf_writer_close(writer);
+        return -1;
+    }
+    result = plan_block(totals, maxLength, block);
+    if (result == 0 && write_code_table(writer, block->codes) == -1) {
+        perror("write");
+        result = -1;
+    }
+    if (buf_writer_close(writer) == -1) {
+        perror("write");
+        result = -1;
+    }
+    free(block);
+    return result;
+}
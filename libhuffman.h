@@ -0,0 +1,69 @@
+#ifndef LIBHUFFMAN_H
+#define LIBHUFFMAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* I/O backends */
+#define HUFF_IO_SYNC 0 /* reads and writes made inline with the coding */
+#define HUFF_IO_THREAD 1 /* a thread reads ahead and another writes behind */
+#define HUFF_IO_MAP 2 /* decoding stores straight into a mapping of the
+                         output file */
+
+/* block codecs */
+#define HUFF_CODEC_HUFFMAN 0 /* prefix codes of whole bits per character */
+#define HUFF_CODEC_ANS 1 /* tANS, fractions of a bit per character */
+#define HUFF_CODEC_BEST 2 /* whichever codes each block smaller */
+#define HUFF_CODEC_PAIRS 3 /* prefix codes with symbols for frequent
+                              byte pairs */
+
+/* how a context codes, huff_default_options gives what hencode does with
+   no flags */
+typedef struct HuffOptions {
+    bool legacy; /* write the pre-versioning format, whole files only */
+    int maxLength; /* code length limit */
+    size_t blockSize; /* input bytes per block, 0 for one block */
+    int streams; /* interleaved streams per block body */
+    int codec; /* one of the HUFF_CODEC values */
+    int threads; /* coding threads, more than 1 codes blocks in parallel */
+    int inFlight; /* blocks held in memory at once, 0 for 2 per thread */
+    bool index; /* append a block index for seeking decoders */
+    bool checksum; /* end every block with a checksum of its characters,
+                      which decoding checks */
+    size_t bufferSize; /* read and write buffer size for files */
+    int io; /* HUFF_IO_SYNC, HUFF_IO_THREAD or HUFF_IO_MAP, for files
+              only */
+    int ioDepth; /* buffers each I/O thread cycles through */
+    bool stats; /* print a line of timings and counts to stderr after
+                   each call; defaults to on when HUFF_STATS is set */
+    const char *table; /* shared code table file from huff_train_table,
+                          NULL for codes of each block's own */
+} HuffOptions;
+
+/* options plus the tables and scratch memory kept between calls; one
+   context is used by one thread at a time */
+typedef struct HuffContext HuffContext;
+
+void huff_default_options(HuffOptions* options);
+HuffContext* huff_context_new(const HuffOptions* options);
+void huff_context_free(HuffContext* context);
+size_t huff_compress_bound(const HuffContext* context, size_t n);
+int huff_compress(HuffContext* context, const void* src, size_t n,
+                    void* dst, size_t capacity, size_t* written);
+int huff_decompressed_size(const void* src, size_t n, uint64_t* size);
+int huff_decompress(HuffContext* context, const void* src, size_t n,
+                    void* dst, size_t capacity, size_t* written);
+int huff_encode_file(HuffContext* context, int in, int out);
+int huff_decode_file(HuffContext* context, int in, int out);
+int huff_decode_file_range(HuffContext* context, int in, int out,
+                            uint64_t offset, uint64_t length);
+int huff_test_file(HuffContext* context, int in);
+int huff_train_table(const int in[], int inCount, int out, int maxLength);
+int huff_encode_batch(const HuffOptions* options, char* const paths[],
+                        size_t count, const char* archive);
+int huff_decode_batch(const HuffOptions* options, char* const paths[],
+                        size_t count);
+int huff_extract_archive(const HuffOptions* options, const char* archive);
+
+#endif
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "./parallel.h"
+#include "./stats.h"
+
+/* slot states */
+#define SLOT_FREE 0 /* waiting for input */
+#define SLOT_QUEUED 1 /* input read, waiting for a worker */
+#define SLOT_BUSY 2 /* being worked on */
+#define SLOT_DONE 3 /* worked on, waiting to be written */
+
+/* called by the reader/writer thread to fill a job, returns 1 when it
+   did, 0 at end of input and -1 on error; called by the workers to do
+   the job, and by the reader/writer thread again to write it out,
+   both returning 0 or -1 */
+typedef int (*JobFunction)(void* job, void* context);
+
+/* one job in flight */
+typedef struct PoolSlot {
+    int state;
+    int result; /* 0, or -1 when the job failed */
+    void *job;
+} PoolSlot;
+
+/* ring of slots shared by the reader/writer thread and the workers;
+   job number n always lives in slot n % slotCount */
+typedef struct OrderedPool {
+    pthread_mutex_t lock;
+    pthread_cond_t workReady; /* a slot was queued, or shutting down */
+    pthread_cond_t jobDone; /* a slot was worked on */
+    PoolSlot *slots;
+    int slotCount;
+    unsigned long nextQueued; /* number of jobs queued so far */
+    unsigned long nextTaken; /* next job a worker picks up */
+    JobFunction work;
+    void *context;
+    HuffStats *stats; /* record of the call the pool works for, or NULL */
+    bool shutdown;
+} OrderedPool;
+
+/* one block in flight for the encoder: raw input and its coded form */
+typedef struct EncodeJob {
+    unsigned char *input; /* copy of the block, unless input is mapped */
+    const unsigned char *data; /* the block, in input or in the mapping */
+    size_t length; /* bytes of input */
+    BufWriter *coded; /* memory-only writer sized to never flush */
+    uint64_t bodyBits;
+} EncodeJob;
+
+typedef struct EncodeContext {
+    BufReader *in;
+    BufWriter *out;
+    size_t blockSize;
+    int maxLength;
+    int streams; /* interleaved streams per block body */
+    int codec; /* HUFF_CODEC value each block is coded with */
+    const HuffCode *shared; /* codes of the shared table, or NULL */
+    bool checksum; /* blocks end in a checksum */
+    BlockIndex *index; /* NULL when no index is kept */
+    uint64_t decodedOffset; /* input bytes written out so far */
+} EncodeContext;
+
+/* one block in flight for the decoder: header, body and decoded form */
+typedef struct DecodeJob {
+    BlockHeader header;
+    DecodeTable table;
+    unsigned char *body; /* copy of the body, unless input is mapped */
+    size_t bodyCapacity;
+    const unsigned char *bodyData; /* the body, in body or in the mapping */
+    size_t bodySize; /* bytes of body and checksum */
+    BufWriter *decoded; /* memory-only writer, regrown for larger blocks */
+} DecodeJob;
+
+typedef struct DecodeContext {
+    BufReader *in;
+    BufWriter *out;
+    int version; /* format version, which says how lengths are written */
+    const DecodeTable *shared; /* lookup table of the shared table, or NULL */
+    bool checksum; /* blocks end in a checksum */
+} DecodeContext;
+
+/* worker: do queued jobs in order of arrival until shutdown */
+static void* pool_worker(void* arg) {
+    OrderedPool *pool = arg;
+    PoolSlot *slot;
+    stats_attach(pool->stats);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->nextTaken == pool->nextQueued) {
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        slot = &pool->slots[pool->nextTaken++ % pool->slotCount];
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->result = pool->work(slot->job, pool->context);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->jobDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* run jobs through a pool of threads: the calling thread reads them in,
+   keeping at most slotCount in memory, and writes them out in the order
+   they were read */
+static int run_ordered_pool(void** jobs, int slotCount, int threads,
+                            JobFunction readJob, JobFunction workJob,
+                            JobFunction writeJob, void* context) {
+    OrderedPool pool;
+    PoolSlot *slot;
+    pthread_t workers[MAX_THREADS];
+    unsigned long nextRead, nextWritten;
+    int i, started, result, status;
+    bool eof;
+
+    pool.slots = calloc(slotCount, sizeof(PoolSlot));
+    if (pool.slots == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < slotCount; i++) {
+        pool.slots[i].job = jobs[i];
+    }
+    pool.slotCount = slotCount;
+    pool.nextQueued = 0;
+    pool.nextTaken = 0;
+    pool.work = workJob;
+    pool.context = context;
+    pool.stats = stats_current();
+    pool.shutdown = false;
+    result = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.workReady, NULL);
+    pthread_cond_init(&pool.jobDone, NULL);
+    started = 0;
+    while (started < threads) {
+        if (pthread_create(&workers[started], NULL, pool_worker,
+                            &pool) != 0) {
+            perror("pthread_create");
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    nextRead = 0;
+    nextWritten = 0;
+    eof = false;
+    while (result == 0) {
+        /* keep the ring full of input */
+        while (!eof && nextRead - nextWritten < (unsigned long)slotCount) {
+            slot = &pool.slots[nextRead % slotCount];
+            status = readJob(slot->job, context);
+            if (status <= 0) {
+                if (status == -1) {
+                    result = -1;
+                }
+                eof = true;
+                break;
+            }
+            pthread_mutex_lock(&pool.lock);
+            slot->state = SLOT_QUEUED;
+            pool.nextQueued++;
+            pthread_cond_signal(&pool.workReady);
+            pthread_mutex_unlock(&pool.lock);
+            nextRead++;
+        }
+        if (result != 0 || nextWritten == nextRead) {
+            break;
+        }
+        /* reorder: write the oldest job once it is done */
+        slot = &pool.slots[nextWritten % slotCount];
+        pthread_mutex_lock(&pool.lock);
+        while (slot->state != SLOT_DONE) {
+            pthread_cond_wait(&pool.jobDone, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (slot->result != 0 || writeJob(slot->job, context) == -1) {
+            result = -1;
+        }
+        slot->state = SLOT_FREE;
+        nextWritten++;
+    }
+
+    /* workers finish the job they hold, then leave */
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.workReady);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool.jobDone);
+    pthread_cond_destroy(&pool.workReady);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.slots);
+    return result;
+}
+
+static int encode_read(void* job, void* context) {
+    EncodeJob *block = job;
+    EncodeContext *encoder = context;
+    ssize_t bytesRead;
+    if (block->input == NULL) {
+        bytesRead = buf_view(encoder->in, &block->data, encoder->blockSize);
+    } else {
+        bytesRead = buf_read(encoder->in, block->input, encoder->blockSize);
+        block->data = block->input;
+    }
+    if (bytesRead == -1) {
+        perror("read");
+        return -1;
+    }
+    block->length = bytesRead;
+    return bytesRead > 0;
+}
+
+static int encode_work(void* job, void* context) {
+    EncodeJob *block = job;
+    EncodeContext *encoder = context;
+    block->coded->count = 0;
+    return encode_block(block->data, block->length, encoder->maxLength,
+                        encoder->streams, encoder->codec, encoder->shared, 
+                        encoder->checksum, block->coded, &block->bodyBits);
+}
+
+static int encode_write(void* job, void* context) {
+    EncodeJob *block = job;
+    EncodeContext *encoder = context;
+    if (encoder->index != NULL && index_add(encoder->index,
+                buf_position(encoder->out), encoder->decodedOffset,
+                block->bodyBits) == -1) {
+        perror("malloc");
+        return -1;
+    }
+    encoder->decodedOffset += block->length;
+    if (buf_write(encoder->out, block->coded->data,
+                    block->coded->count) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+/* stream input in blocks coded by a pool of threads; blocks are written
+   in input order, at most inFlight of them are held in memory, and each
+   is added to index unless it is NULL */
+int encode_parallel(BufReader* in, BufWriter* out, size_t blockSize,
+                    int maxLength, int streams, int codec, 
+                    const HuffCode shared[], bool checksum, int threads, 
+                    int inFlight, BlockIndex* index) {
+    EncodeContext encoder;
+    EncodeJob *blocks;
+    void **jobs;
+    int i, result;
+
+    blocks = calloc(inFlight, sizeof(EncodeJob));
+    jobs = malloc(inFlight * sizeof(void*));
+    result = blocks == NULL || jobs == NULL ? -1 : 0;
+    for (i = 0; result == 0 && i < inFlight; i++) {
+        jobs[i] = &blocks[i];
+        if (!in->borrowed && (blocks[i].input = malloc(blockSize)) == NULL) {
+            result = -1;
+        }
+        /* memory-only writer, a block's code never outgrows its bound */
+        blocks[i].coded = buf_writer_open(-1, encoded_block_bound(blockSize));
+        if (blocks[i].coded == NULL) {
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        encoder.in = in;
+        encoder.out = out;
+        encoder.blockSize = blockSize;
+        encoder.maxLength = maxLength;
+        encoder.streams = streams;
+        encoder.codec = codec;
+        encoder.shared = shared;
+        encoder.checksum = checksum;
+        encoder.index = index;
+        encoder.decodedOffset = 0;
+        result = run_ordered_pool(jobs, inFlight, threads, encode_read,
+                                    encode_work, encode_write, &encoder);
+    } else {
+        perror("malloc");
+    }
+    for (i = 0; blocks != NULL && i < inFlight; i++) {
+        free(blocks[i].input);
+        if (blocks[i].coded != NULL) {
+            blocks[i].coded->count = 0; /* nothing left to flush */
+            buf_writer_close(blocks[i].coded);
+        }
+    }
+    free(blocks);
+    free(jobs);
+    return result;
+}
+
+/* read the next block header, its body and its checksum; buffers grow
+   to fit them */
+static int decode_read(void* job, void* context) {
+    DecodeJob *block = job;
+    DecodeContext *decoder = context;
+    unsigned char *body;
+    ssize_t bodyRead;
+    size_t needed;
+
+    if (read_block_header(decoder->in, decoder->version,
+                            &block->header) == -1) {
+        return -1;
+    }
+    if (block->header.type == BLOCK_END) {
+        return 0;
+    }
+    block->bodySize = block->header.bodyLength;
+    if (decoder->checksum) {
+        block->bodySize += BLOCK_CHECKSUM_SIZE;
+    }
+    /* a mapped input is decoded in place, anything else is copied */
+    bodyRead = buf_view(decoder->in, &block->bodyData, block->bodySize);
+    if (bodyRead == -1) {
+        if (block->bodySize > block->bodyCapacity) {
+            body = realloc(block->body, block->bodySize);
+            if (body == NULL) {
+                perror("malloc");
+                return -1;
+            }
+            block->body = body;
+            block->bodyCapacity = block->bodySize;
+        }
+        bodyRead = buf_read(decoder->in, block->body, block->bodySize);
+        block->bodyData = block->body;
+    }
+    if (bodyRead != (ssize_t)block->bodySize) {
+        fprintf(stderr, "truncated block body\n");
+        return -1;
+    }
+    /* room for the block, plus what decode_body writes past a flush */
+    needed = (size_t)block->header.charCount + DECODE_MAX_SYMBOLS;
+    if (block->decoded == NULL || block->decoded->size < needed) {
+        if (block->decoded != NULL) {
+            block->decoded->count = 0;
+            buf_writer_close(block->decoded);
+        }
+        block->decoded = buf_writer_open(-1, needed);
+        if (block->decoded == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static int decode_work(void* job, void* context) {
+    DecodeJob *block = job;
+    DecodeContext *decoder = context;
+    BufReader *body;
+    int result;
+    body = buf_reader_wrap(block->bodyData, block->bodySize);
+    if (body == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    block->decoded->count = 0;
+    result = decode_block(&block->header, &block->table, decoder->shared,
+                            decoder->checksum, body, block->decoded);
+    buf_reader_close(body);
+    return result;
+}
+
+static int decode_write(void* job, void* context) {
+    DecodeJob *block = job;
+    DecodeContext *decoder = context;
+    if (buf_write(decoder->out, block->decoded->data,
+                    block->decoded->count) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+/* decode the blocks of a versioned file with a pool of threads, up to
+   the end block; blocks are written in file order and at most inFlight
+   of them are held in memory, each checked against its checksum by the
+   thread that decodes it */
+int decode_parallel(BufReader* in, BufWriter* out, int version,
+                    const DecodeTable* shared, bool checksum, int threads,
+                    int inFlight) {
+    DecodeContext decoder;
+    DecodeJob *blocks;
+    void **jobs;
+    int i, result;
+
+    blocks = calloc(inFlight, sizeof(DecodeJob));
+    jobs = malloc(inFlight * sizeof(void*));
+    if (blocks == NULL || jobs == NULL) {
+        perror("malloc");
+        result = -1;
+    } else {
+        for (i = 0; i < inFlight; i++) {
+            jobs[i] = &blocks[i];
+        }
+        decoder.in = in;
+        decoder.out = out;
+        decoder.shared = shared;
+        decoder.version = version;
+        decoder.checksum = checksum;
+        result = run_ordered_pool(jobs, inFlight, threads, decode_read,
+                                    decode_work, decode_write, &decoder);
+    }
+    for (i = 0; blocks != NULL && i < inFlight; i++) {
+        free(blocks[i].body);
+        if (blocks[i].decoded != NULL) {
+            blocks[i].decoded->count = 0;
+            buf_writer_close(blocks[i].decoded);
+        }
+    }
+    free(blocks);
+    free(jobs);
+    return result;
+}
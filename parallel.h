@@ -0,0 +1,16 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "./block.h"
+
+#define MAX_THREADS 256 /* upper bound for -j */
+
+int encode_parallel(BufReader* in, BufWriter* out, size_t blockSize,
+                    int maxLength, int streams, int codec, 
+                    const HuffCode shared[], bool checksum, int threads, 
+                    int inFlight, BlockIndex* index);
+int decode_parallel(BufReader* in, BufWriter* out, int version,
+                    const DecodeTable* shared, bool checksum, int threads,
+                    int inFlight);
+
+#endif
@@ -0,0 +1,244 @@
+#define _DEFAULT_SOURCE /* clock_gettime, flockfile */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "./stats.h"
+#include "./huffman.h"
+
+/* what one library call did, filled in while it runs by the calling
+   thread and any threads working for it */
+struct HuffStats {
+    pthread_mutex_t lock;
+    double seconds[STAT_PHASES];
+    uint64_t bytesIn; /* read from files, or handed in as memory */
+    uint64_t bytesOut;
+    uint64_t reads; /* read system calls */
+    uint64_t writes; /* write system calls */
+    uint64_t characters; /* coded or decoded */
+    uint64_t bodyBits; /* body bits before padding, over all blocks */
+    double entropyBits; /* Shannon bound of the histograms, encoding only */
+    int maxLength; /* longest code of any block */
+    double start;
+};
+
+static const char *phaseNames[STAT_PHASES] = {
+    "histogram", "tree", "table", "encode", "decode", "read", "write",
+    "checksum"
+};
+
+/* the record each thread adds into, NULL when its work is not being
+   measured, so the hooks cost one lookup when stats are off */
+static pthread_key_t currentKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+
+static void make_key(void) {
+    pthread_key_create(&currentKey, NULL);
+}
+
+/* an empty record, NULL if out of memory */
+HuffStats* stats_new(void) {
+    HuffStats *stats = calloc(1, sizeof(HuffStats));
+    if (stats != NULL) {
+        pthread_mutex_init(&stats->lock, NULL);
+    }
+    return stats;
+}
+
+void stats_free(HuffStats* stats) {
+    if (stats != NULL) {
+        pthread_mutex_destroy(&stats->lock);
+        free(stats);
+    }
+}
+
+/* the record the calling thread adds into, or NULL */
+HuffStats* stats_current(void) {
+    pthread_once(&keyOnce, make_key);
+    return pthread_getspecific(currentKey);
+}
+
+/* have the calling thread add into stats, the record of the call it
+   works for, which it took from stats_current in that call's thread;
+   NULL stops it adding */
+void stats_attach(HuffStats* stats) {
+    pthread_once(&keyOnce, make_key);
+    pthread_setspecific(currentKey, stats);
+}
+
+/* whether the calling thread's work is being measured, for work done
+   only to be reported */
+bool stats_active(void) {
+    return stats_current() != NULL;
+}
+
+/* monotonic seconds, or 0 without a clock call when not collecting */
+double stats_clock(void) {
+    struct timespec now;
+    if (stats_current() == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* add the time since start, from stats_clock, to phase */
+void stats_phase(int phase, double start) {
+    HuffStats *stats = stats_current();
+    double end;
+    if (stats == NULL || start == 0) {
+        return;
+    }
+    end = stats_clock();
+    pthread_mutex_lock(&stats->lock);
+    stats->seconds[phase] += end - start;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* count one read (STAT_READ) or write (STAT_WRITE) system call that
+   moved bytes, adding the time since start */
+void stats_io(int phase, double start, uint64_t bytes) {
+    HuffStats *stats = stats_current();
+    if (stats == NULL) {
+        return;
+    }
+    stats_phase(phase, start);
+    pthread_mutex_lock(&stats->lock);
+    if (phase == STAT_READ) {
+        stats->reads++;
+        stats->bytesIn += bytes;
+    } else {
+        stats->writes++;
+        stats->bytesOut += bytes;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* count input taken and output given without system calls, from
+   memory or a mapping */
+void stats_bytes(uint64_t in, uint64_t out) {
+    HuffStats *stats = stats_current();
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&stats->lock);
+    stats->bytesIn += in;
+    stats->bytesOut += out;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* record a block about to be coded with codes of at most maxLength bits
+   taking bodyBits for the characters of histogram */
+void stats_coded(const uint64_t histogram[], int maxLength,
+                    uint64_t bodyBits) {
+    HuffStats *stats = stats_current();
+    double total = 0, entropy = 0;
+    int i;
+    if (stats == NULL) {
+        return;
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        total += histogram[i];
+    }
+    for (i = 0; i < ASCII_TABLE_LENGTH; i++) {
+        if (histogram[i] > 0) {
+            entropy += histogram[i] * log(total / histogram[i]);
+        }
+    }
+    pthread_mutex_lock(&stats->lock);
+    stats->characters += total;
+    stats->bodyBits += bodyBits;
+    stats->entropyBits += entropy / log(2);
+    if (maxLength > stats->maxLength) {
+        stats->maxLength = maxLength;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* record a block decoded from a body of bodyBits */
+void stats_decoded(uint64_t characters, int maxLength, uint64_t bodyBits) {
+    HuffStats *stats = stats_current();
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&stats->lock);
+    stats->characters += characters;
+    stats->bodyBits += bodyBits;
+    stats->entropyBits = -1; /* histograms are not known */
+    if (maxLength > stats->maxLength) {
+        stats->maxLength = maxLength;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* start collecting into stats for one call made on the calling thread;
+   false when the thread is already in a measured call, which keeps
+   the record */
+bool stats_begin(HuffStats* stats) {
+    double start;
+    if (stats_current() != NULL) {
+        return false;
+    }
+    stats_attach(stats);
+    start = stats_clock();
+    pthread_mutex_lock(&stats->lock);
+    memset(stats->seconds, 0, sizeof(stats->seconds));
+    stats->bytesIn = 0;
+    stats->bytesOut = 0;
+    stats->reads = 0;
+    stats->writes = 0;
+    stats->characters = 0;
+    stats->bodyBits = 0;
+    stats->entropyBits = 0;
+    stats->maxLength = 0;
+    stats->start = start;
+    pthread_mutex_unlock(&stats->lock);
+    return true;
+}
+
+/* stop collecting into stats and print it as one line of key=value
+   pairs on stderr; entropy and bits are per character, entropy is "-"
+   when decoding */
+void stats_end(HuffStats* stats, const char* operation) {
+    HuffStats copy;
+    struct rusage usage;
+    double seconds;
+    int i;
+    seconds = stats_clock();
+    stats_attach(NULL);
+    /* threads of the call are done, but take what they left under the
+       lock */
+    pthread_mutex_lock(&stats->lock);
+    copy = *stats;
+    pthread_mutex_unlock(&stats->lock);
+    seconds -= copy.start;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        usage.ru_maxrss = 0;
+    }
+
+    flockfile(stderr); /* batch workers end at once; keep lines whole */
+    fprintf(stderr, "huffstats op=%s seconds=%.6f", operation, seconds);
+    for (i = 0; i < STAT_PHASES; i++) {
+        fprintf(stderr, " %s=%.6f", phaseNames[i], copy.seconds[i]);
+    }
+    fprintf(stderr, " bytes_in=%lu bytes_out=%lu reads=%lu writes=%lu "
+            "characters=%lu max_code_length=%d",
+            (unsigned long)copy.bytesIn, (unsigned long)copy.bytesOut,
+            (unsigned long)copy.reads, (unsigned long)copy.writes,
+            (unsigned long)copy.characters, copy.maxLength);
+    if (copy.entropyBits < 0 || copy.characters == 0) {
+        fprintf(stderr, " entropy=-");
+    } else {
+        fprintf(stderr, " entropy=%.4f",
+                copy.entropyBits / copy.characters);
+    }
+    fprintf(stderr, " bits_per_char=%.4f peak_rss_kib=%ld\n",
+            copy.characters > 0 ?
+            (double)copy.bodyBits / copy.characters : 0,
+            (long)usage.ru_maxrss);
+    funlockfile(stderr);
+}
@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* phases timed while collecting; threads add their times together */
+enum {
+    STAT_HISTOGRAM, /* counting characters */
+    STAT_TREE, /* code tree, code lengths and canonical codes */
+    STAT_TABLE, /* decode lookup tables */
+    STAT_ENCODE, /* coding bodies */
+    STAT_DECODE, /* decoding bodies, with any reads done meanwhile */
+    STAT_READ, /* read system calls */
+    STAT_WRITE, /* write system calls */
+    STAT_CHECKSUM, /* block checksums, some taken while decoding */
+    STAT_PHASES
+};
+
+/* what one library call did; each context keeps its own */
+typedef struct HuffStats HuffStats;
+
+HuffStats* stats_new(void);
+void stats_free(HuffStats* stats);
+HuffStats* stats_current(void);
+void stats_attach(HuffStats* stats);
+bool stats_active(void);
+double stats_clock(void);
+void stats_phase(int phase, double start);
+void stats_io(int phase, double start, uint64_t bytes);
+void stats_bytes(uint64_t in, uint64_t out);
+void stats_coded(const uint64_t histogram[], int maxLength,
+                    uint64_t bodyBits);
+void stats_decoded(uint64_t characters, int maxLength, uint64_t bodyBits);
+bool stats_begin(HuffStats* stats);
+void stats_end(HuffStats* stats, const char* operation);
+
+#endif